@@ -5,10 +5,15 @@
 #include "discamb/MathUtilities/Vector3.h"
 #include "discamb/Scattering/SfCalculator.h"
 
+#include <cstddef>
+#include <map>
 #include <string>
+#include <utility>
 #include <vector>
 #include <complex>
 
+#include "IamKernel.hpp"
+
 
 struct FCalcDerivatives : discamb::SfDerivativesAtHkl {
     std::vector<int> hkl;
@@ -20,6 +25,33 @@ struct FCalcDerivatives : discamb::SfDerivativesAtHkl {
     std::vector<std::vector<std::complex<double>>> siteDerivatives() const;
 };
 
+// Timings are in seconds, for the most recent call of each kind
+struct CalculatorStats {
+    int n_atoms = 0;
+    int n_isotropic_groups = 0;
+    double update_time = 0.0;
+    double f_calc_time = 0.0;
+    double derivatives_time = 0.0;
+    // Fraction of atom-reflection terms skipped by pruning in the latest f_calc,
+    // and an upper bound of the resulting error |F_pruned - F| for any reflection
+    double pruned_fraction = 0.0;
+    double pruning_error_bound = 0.0;
+    // Atoms whose tabulated form factors were recomputed in the latest update
+    int n_frames_updated = 0;
+    // Atoms typed by the wrapper for a TAAM calculator, counting the surroundings typed 
+    // with them, and the time taken. Zero when restored or when discamb types the structure
+    int n_typed_atoms = 0;
+    double typing_time = 0.0;
+};
+
+// Atom whose site, U_iso and occupancy follow its parent atom
+struct RidingAtom {
+    int atom;
+    int parent;
+    discamb::Vector3d offset; // Fractional, from the parent
+    double uIsoFactor;        // U_iso = uIsoFactor * U_eq(parent)
+};
+
 class DiscambStructureFactorCalculator {
     public:
         DiscambStructureFactorCalculator() = default;
@@ -30,18 +62,182 @@ class DiscambStructureFactorCalculator {
         );
         // ~DiscambStructureFactorCalculator(); // TODO
 
-        std::vector<std::complex<double>> f_calc();
+        // An empty set name refers to hkl, other names to sets added with set_reflection_set.
+        // Replace hkl through set_reflection_set, so data derived from it is refreshed
+        std::vector<std::complex<double>> f_calc(const std::string &set_name = "");
 
-        std::vector<FCalcDerivatives> d_f_calc_d_params();
+        std::vector<FCalcDerivatives> d_f_calc_d_params(const std::string &set_name = "");
+        // Parallel over the indices with the kernel, serial through discamb
+        std::vector<FCalcDerivatives> d_f_calc_d_params(const std::vector<discamb::Vector3i> &indices);
         FCalcDerivatives d_f_calc_hkl_d_params(int h, int k, int l);
-        std::vector<discamb::TargetFunctionAtomicParamDerivatives> d_target_d_params(std::vector<std::complex<double>> d_target_d_f_calc);
+        // One array of structure factors per set of per-atom anomalous terms (f' + i f''), from one 
+        // evaluation of the model and one pass over the atoms with anomalous terms. Uses the kernel if set
+        std::vector<std::vector<std::complex<double>>> f_calc_anomalous_sets(
+            const std::vector<std::vector<std::complex<double>>> &anomalous_sets,
+            const std::string &set_name = ""
+        );
+        std::vector<discamb::TargetFunctionAtomicParamDerivatives> d_target_d_params(
+            std::vector<std::complex<double>> d_target_d_f_calc, 
+            const std::string &set_name = ""
+        );
         
+        // Structure factors of the model for each table, e.g. X-ray, electron and neutron, sharing the 
+        // phase and Debye-Waller sums. f' and f'' apply to X-ray tables only. Requires use_iam_kernel
+        std::vector<std::vector<std::complex<double>>> f_calc_joint(
+            const std::vector<std::string> &tables,
+            const std::string &set_name = ""
+        );
+        // Derivatives of the joint target sum_r weights[r] T_r, with dT_r/dF_r in d_target_d_f_calc[r], 
+        // in the conventions of d_target_d_params. Empty weights are all 1
+        std::vector<discamb::TargetFunctionAtomicParamDerivatives> d_target_d_params_joint(
+            const std::vector<std::string> &tables,
+            std::vector<std::vector<std::complex<double>>> d_target_d_f_calc,
+            const std::vector<double> &weights = {},
+            const std::string &set_name = ""
+        );
+
+        // Intensities of a twinned crystal, I(h) = sum_k fractions[k] |F(h R_k)|^2, with one integer 
+        // 3x3 twin law R_k per domain, including the identity for the reference domain. F is calculated 
+        // once on the unique twin-related indices, kept as a hidden reflection set between calls
+        std::vector<double> i_calc_twinned(
+            const std::vector<std::vector<std::vector<int>>> &twin_laws,
+            const std::vector<double> &fractions,
+            const std::string &set_name = ""
+        );
+        // Derivatives of a target of the twinned intensities, from dT/dI per reflection, in the 
+        // conventions of d_target_d_params. The derivatives with respect to the fractions go to d_target_d_fractions
+        std::vector<discamb::TargetFunctionAtomicParamDerivatives> d_target_d_params_twinned(
+            const std::vector<std::vector<std::vector<int>>> &twin_laws,
+            const std::vector<double> &fractions,
+            const std::vector<double> &d_target_d_i_calc,
+            std::vector<double> &d_target_d_fractions,
+            const std::string &set_name = ""
+        );
+
+        const discamb::Crystal &crystal() const { return mCrystal; };
+        const CalculatorStats &stats() const { return mStats; };
+        // Type assignment done by the owner before construction, reported in the stats
+        void set_typing_stats(int n_typed_atoms, double typing_time);
+
+        // Take the contributions of some atoms from a second calculator, e.g. TAAM for a ligand.
+        // The calculator's crystal holds the given atoms, and those flagged as counted are 
+        // summed by it instead of the main calculator. The others only provide context, e.g. for typing
+        void set_subset_calculator(
+            discamb::SfCalculator *calculator, 
+            const std::vector<int> &atoms, 
+            const std::vector<bool> &counted
+        );
+        // Evaluate IAM structure factors and derivatives with IamKernel instead of discamb.
+        // Neutron tables (see is_neutron_table) are only available here, and rule out pruning, 
+        // which evaluates the discamb calculator
+        void use_iam_kernel(const std::string &table);
+        // Evaluate structure factors and derivatives with IamKernel, taking the atomic form factors 
+        // of all atoms from the discamb calculator, e.g. TAAM. These are tabulated once per reflection set 
+        // at every symmetry-rotated index. frame_atoms lists, per atom, the atoms defining its local 
+        // coordinate system (see local_coordinate_system_atoms). After parameter updates, only atoms 
+        // with a moved frame atom are tabulated again, or all atoms if frame_atoms is empty.
+        // A table holds 16 bytes per atom, reflection and symmetry operation, so it suits small 
+        // molecules and small reflection sets. Tables larger than max_table_bytes throw std::length_error.
+        // With mott_bethe, the discamb calculator is expected to give X-ray form factors, which are 
+        // converted to electron scattering factors while tabulating, f_e = C (Z - f_x) / s^2, with
+        // C / s^2 computed once per reflection set. hkl = 0 then throws std::domain_error, and nonzero 
+        // anomalous terms, here or in later updates, fail an assertion. Pruning evaluates the discamb 
+        // calculator directly and is not available
+        void use_tabulated_kernel(
+            const std::vector<std::vector<int>> &frame_atoms = {},
+            std::size_t max_table_bytes = std::size_t(1) << 31,
+            bool mott_bethe = false
+        );
+        // In f_calc, skip atoms whose estimated contribution to any reflection in a resolution
+        // shell is below tolerance. A tolerance of 0 disables pruning
+        void set_pruning(double tolerance, int n_shells = 10);
+        // Constrain each (atom, parent) pair to ride on the parent, keeping the current offset. 
+        // Derivatives are then chain-ruled onto the parents and only given for free atoms
+        void set_riding_atoms(const std::vector<std::pair<int, int>> &riding_pairs, double u_iso_factor);
+        // Indices of atoms with their own parameters, in the order of the derivative arrays
+        const std::vector<int> &free_atoms() const { return mFreeAtoms; };
+        // Replace atomic parameters and anomalous terms. Atom count and types must be unchanged
+        void update_parameters(
+            const std::vector<discamb::AtomInCrystal> &atoms, 
+            const std::vector<std::complex<double>> &anomalous
+        );
+
+        void set_reflection_set(const std::string &set_name, std::vector<discamb::Vector3i> indices);
+        void remove_reflection_set(const std::string &set_name);
+        const std::vector<discamb::Vector3i> &reflection_set(const std::string &set_name) const;
+        std::vector<std::string> reflection_set_names() const;
+
         std::vector<discamb::Vector3i> hkl;
 
     private:
         discamb::SfCalculator *mCalculator; // Pointer since abstract class
         discamb::Crystal mCrystal;
         std::vector<std::complex<double>> mAnomalous;
+        // Atoms summed by mCalculator, false for those taken from mSubsetCalculator
+        std::vector<bool> mMainContribution;
+        discamb::SfCalculator *mSubsetCalculator = nullptr;
+        std::vector<int> mSubsetAtoms;
+        std::vector<bool> mSubsetContribution;
+        std::vector<discamb::AtomInCrystal> subset_atoms() const;
+        void set_subset_anomalous(const std::vector<std::complex<double>> &anomalous);
+        void add_subset_f_calc(const std::vector<discamb::Vector3i> &indices, std::vector<std::complex<double>> &sf);
+        void add_subset_derivatives(const discamb::Vector3i &hkl, std::complex<double> &f, discamb::SfDerivativesAtHkl &derivatives);
+        void add_subset_target_derivatives(
+            const std::vector<discamb::Vector3i> &indices,
+            const std::vector<std::complex<double>> &d_target_d_f_calc,
+            std::vector<discamb::TargetFunctionAtomicParamDerivatives> &derivatives
+        );
+        IamKernel mKernel;
+        bool mUseKernel = false;
+        // Index-dependent kernel data per reflection set, cleared when the set changes
+        std::map<std::string, IamKernel::Reflections> mKernelReflections;
+        bool mTabulatedKernel = false;
+        std::size_t mMaxTableBytes = 0;
+        const IamKernel::Reflections &kernel_reflections(const std::string &set_name);
+        // Form factors per reflection set and table for joint evaluations, cleared with mKernelReflections
+        std::map<std::string, std::map<std::string, std::vector<double>>> mRadiationFormFactors;
+        std::vector<IamKernel::Radiation> radiations(const std::vector<std::string> &tables, const std::string &set_name);
+        // For each atom, the atoms whose local coordinate systems it helps define
+        std::vector<std::vector<int>> mFrameDependents;
+        // Sites the cached form factor tables were computed with, 3 per atom
+        std::vector<double> mTabulatedSites;
+        bool mMottBethe = false;
+        // The discamb calculator does not give the kernel's form factors, e.g. for Mott-Bethe or neutrons
+        bool mKernelOnly = false;
+        std::vector<double> mNuclearCharges;
+        IamKernel::Reflections prepare_kernel_reflections(const std::vector<discamb::Vector3i> &indices);
+        void tabulate_form_factors(IamKernel::Reflections &reflections, const std::vector<bool> &atoms);
+        void update_tabulated_form_factors();
+        CalculatorStats mStats;
+        double mPruningTolerance = 0.0;
+        int mPruningShells = 10;
+        void f_calc_pruned(const std::vector<discamb::Vector3i> &indices, std::vector<std::complex<double>> &sf);
+        std::vector<double> minimum_mean_square_displacements() const;
+        std::vector<RidingAtom> mRidingAtoms;
+        std::vector<int> mFreeAtoms;
+        void apply_riding_constraints();
+        // Chain rule onto parents, then drop the riding atoms. The target
+        // derivatives are expected in U_cart, the structure factor derivatives in the crystal's conventions
+        void constrain_derivatives(std::vector<discamb::TargetFunctionAtomicParamDerivatives> &derivatives) const;
+        void constrain_derivatives(discamb::SfDerivativesAtHkl &derivatives) const;
+        // Name of the hidden set with the unique indices h R_k of a named set, updated if needed. 
+        // unionIndex[i * nLaws + k] is the position of reflection i under law k in it
+        std::string twinned_set(
+            const std::vector<std::vector<std::vector<int>>> &twin_laws,
+            const std::string &set_name,
+            std::vector<int> &unionIndex
+        );
+        // Named sets, e.g. work/free, kept in native form so switching between them is free
+        std::map<std::string, std::vector<discamb::Vector3i>> mReflectionSets;
         discamb::StructuralParametersConverter mConverter;
+        // Row-major linear maps taking derivatives from the crystal's 
+        // conventions to Cartesian coordinates and U_cart, fixed per unit cell
+        double mXyzDerivativeConversion[3][3];
+        double mAdpDerivativeConversion[6][6];
+        // U_eq as a linear function of anisotropic ADPs in the crystal's convention
+        double mUeqFromAdp[6];
+        void set_derivative_conversion();
+        void convert_derivatives(std::vector<discamb::TargetFunctionAtomicParamDerivatives> &derivatives) const;
         void update_calculator();
+        void update_kernel();
 };
@@ -10,8 +10,11 @@
 #include <string>
 #include <vector>
 #include <complex>
+#include <tuple>
+#include <utility>
 
 #include "DiscambStructureFactorCalculator.hpp"
+#include "atom_assignment.hpp"
 
 namespace py = pybind11;
 
@@ -22,8 +25,22 @@ enum FCalcMethod {
 
 class DiscambWrapper {
     public:
-        DiscambWrapper(py::object structure, FCalcMethod method = FCalcMethod::IAM);
+        // TAAM types are assigned once in the wrapper, with residue templates for polymers,
+        // and the discamb calculator is built from that assignment.
+        // native_kernel sums structure factors in the wrapper, see IamKernel. For TAAM,
+        // the atomic form factors are tabulated from discamb per reflection set, and
+        // converted to electron scattering in the wrapper for electron tables. The table takes 
+        // 16 bytes per atom, reflection and symmetry operation, e.g. about 1.9 GB for 1000 atoms, 
+        // 30000 reflections and 4 operations, so TAAM with the kernel is not for proteins. 
+        // Reflection sets whose table would exceed max_table_bytes throw std::length_error
+        DiscambWrapper(
+            py::object structure, 
+            FCalcMethod method = FCalcMethod::IAM, 
+            bool native_kernel = false, 
+            std::size_t max_table_bytes = std::size_t(1) << 31
+        );
 
+        // With any log or multipole CIF path, discamb sets up and types the model itself, to write them
         static DiscambWrapper from_TAAM_parameters(
             py::object structure,
             bool convert_to_electron_scattering,
@@ -35,22 +52,116 @@ class DiscambWrapper {
             bool perform_parameter_scaling_from_unit_cell_charge
         );
 
-        void set_indices(py::object indices);
-        void set_d_min(const double d_min);
+        // TAAM calculator from a file written by save_TAAM_setup, for restarting a refinement.
+        // The saved types, local coordinate systems and multipole parameters are used without typing
+        static DiscambWrapper from_TAAM_setup(
+            py::object structure, 
+            const std::string &setup_filepath, 
+            bool native_kernel = false,
+            std::size_t max_table_bytes = std::size_t(1) << 31
+        );
+
+        // TAAM for the selected atoms, IAM for the rest
+        static DiscambWrapper from_hybrid_model(
+            py::object structure,
+            std::vector<bool> taam_selection,
+            double context_radius = 4.0
+        );
+
+        // Indices without a set name are the default set, used when no set name is given
+        void set_indices(py::object indices, const std::string &set_name = "");
+        void set_d_min(const double d_min, const bool sort_by_resolution = false);
+        std::vector<std::tuple<int, int, int>> get_indices(const std::string &set_name = "") const;
+        void remove_indices(const std::string &set_name);
+        std::vector<std::string> reflection_set_names() const;
 
         std::vector<std::complex<double>> f_calc();
         std::vector<std::complex<double>> f_calc(const double d_min);
+        std::vector<std::complex<double>> f_calc(const std::string &set_name);
+        std::vector<std::vector<std::complex<double>>> f_calc_multi_wavelength(
+            std::vector<std::vector<std::complex<double>>> anomalous_sets,
+            const std::string &set_name = ""
+        );
+
+        // One array per table, e.g. for joint X-ray and neutron refinement. Requires native_kernel with IAM
+        std::vector<std::vector<std::complex<double>>> f_calc_joint(
+            const std::vector<std::string> &tables,
+            const std::string &set_name = ""
+        );
+        std::vector<discamb::TargetFunctionAtomicParamDerivatives> d_target_d_params_joint(
+            const std::vector<std::string> &tables,
+            std::vector<std::vector<std::complex<double>>> d_target_d_f_calc,
+            const std::vector<double> &weights = {},
+            const std::string &set_name = ""
+        );
+
+        // Twinned intensities sum_k fractions[k] |F(h R_k)|^2, with F calculated once on the twin-related indices
+        std::vector<double> i_calc_twinned(
+            const std::vector<std::vector<std::vector<int>>> &twin_laws,
+            const std::vector<double> &fractions,
+            const std::string &set_name = ""
+        );
+        // Derivatives with respect to the atomic parameters and the twin fractions
+        std::pair<std::vector<discamb::TargetFunctionAtomicParamDerivatives>, std::vector<double>> d_target_d_params_twinned(
+            const std::vector<std::vector<std::vector<int>>> &twin_laws,
+            const std::vector<double> &fractions,
+            const std::vector<double> &d_target_d_i_calc,
+            const std::string &set_name = ""
+        );
 
         std::vector<FCalcDerivatives> d_f_calc_d_params();
+        std::vector<FCalcDerivatives> d_f_calc_d_params(std::vector<std::vector<int>> indices);
+        std::vector<FCalcDerivatives> d_f_calc_d_params(const std::string &set_name);
         FCalcDerivatives d_f_calc_hkl_d_params(py::tuple hkl);
         FCalcDerivatives d_f_calc_hkl_d_params(int h, int k, int l);
-        std::vector<discamb::TargetFunctionAtomicParamDerivatives> d_target_d_params(std::vector<std::complex<double>> d_target_d_f_calc);
+        std::vector<discamb::TargetFunctionAtomicParamDerivatives> d_target_d_params(
+            std::vector<std::complex<double>> d_target_d_f_calc, 
+            const std::string &set_name = ""
+        );
+
+        // Read sites, ADPs, occupancies and anomalous terms from the structure again
+        void update_parameters();
+        void set_pruning(double tolerance, int n_shells = 10);
+        // Without pairs, each H rides on the closest non-H atom within 1.3 A
+        void set_riding_hydrogens(std::vector<std::pair<int, int>> riding_pairs = {}, double u_iso_factor = 1.2);
+        std::vector<int> free_atom_indices() const;
+        const CalculatorStats &stats() const;
+        // Store the TAAM calculator settings and type assignment, with a bank reduced to the types of this structure
+        void save_TAAM_setup(const std::string &setup_filepath) const;
         
     private:
         py::object mStructure;
+        // Type assignment of a native or restored TAAM calculator, shared by its discamb calculator and its frames
+        TaamModel mTaamModel;
         DiscambStructureFactorCalculator mDiscambCalculator;
+        // Read from the structure on construction and in update_parameters, so set_d_min does not call into cctbx
+        bool mAnomalousFlag;
+        bool mReferenceSetting;
+        // Settings of the model. The discamb calculator of a native TAAM kernel gives X-ray form factors
+        nlohmann::json mCalculatorParameters;
+
+        // Reads the structure once, for both the calculator and the wrapper
+        DiscambWrapper(
+            py::object structure, 
+            const discamb::Crystal &crystal, 
+            nlohmann::json calculator_params, 
+            bool native_kernel = false,
+            std::size_t max_table_bytes = std::size_t(1) << 31,
+            TaamModel taam_model = TaamModel()
+        );
 };
 
 std::vector<std::complex<double>> calculate_structure_factors_TAAM(py::object structure, const double d);
 
 std::vector<std::complex<double>> calculate_structure_factors_IAM(py::object structure, const double d);
+
+// Default TAAM databank, resolved on first use
+const std::string &default_databank();
+
+// Bank with only the TAAM types assigned in the structures, for use with from_TAAM_parameters.
+// Other structures may need types left out. An empty bank_filepath reads the default databank
+int write_assigned_types_databank(
+    std::vector<py::object> structures, 
+    const std::string &output_filepath, 
+    std::string bank_filepath = ""
+);
@@ -0,0 +1,201 @@
+#pragma once
+
+#include "discamb/CrystalStructure/Crystal.h"
+#include "discamb/MathUtilities/Vector3.h"
+#include "discamb/Scattering/SfCalculator.h"
+
+#include <complex>
+#include <string>
+#include <vector>
+
+#include "crystal_geometry.hpp"
+#include "scattering_table.hpp"
+
+// Independent atom model structure factors by direct summation over atoms and
+// symmetry operations, evaluated in the wrapper rather than through discamb::SfCalculator.
+// Isotropic atoms sharing scattering type, U_iso and anomalous terms are grouped, so in f_calc the 
+// Debye-Waller factor and the form factor product are applied once per group and reflection. 
+// Form factors are evaluated per type either way, and the phase sums per atom dominate, 
+// so the gain is modest (about 10% of f_calc for 2000 atoms in three groups) and derivatives are unaffected.
+// Grouping is limited to this opt-in kernel with IAM form factors: tabulated atoms each have
+// their own form factors, from their own local frames, and are summed individually.
+// Derivatives are given in the crystal's conventions (fractional coordinates, U_iso or U_star),
+// like those from discamb.
+// Atoms flagged as tabulated instead take their form factors, for each reflection and 
+// symmetry operation, from the Reflections data, filled by the caller, e.g. from a TAAM calculator.
+// Form factors are evaluated per reflection with a loop over the Gaussian terms. Evaluators 
+// specialised on the term count were no faster, since exp dominates, and the form factors 
+// take under 1 ms of a 0.7 s f_calc for 2000 atoms
+class IamKernel {
+    public:
+        // Quantities depending only on the indices, computed once per reflection set.
+        // Entries for reflection i and operation j are at i * nOperations + j
+        struct Reflections {
+            int nOperations = 0;
+            int nFormFactorTypes = 0;
+            std::vector<double> dStarSq;
+            std::vector<double> rotated;     // 3 per entry, h R
+            std::vector<double> shifts;      // 1 per entry, h t
+            // 6 per entry, quadratic monomials of h R matching the U_star order:
+            // h1^2, h2^2, h3^2, 2 h1 h2, 2 h1 h3, 2 h2 h3
+            std::vector<double> monomials;
+            std::vector<double> formFactors; // nFormFactorTypes per reflection
+            // Tabulated atom t at entry e is at t * size() * nOperations + e
+            std::vector<std::complex<double>> tabulated;
+            // 1 per reflection, C / s^2 of the Mott-Bethe formula, when tabulated X-ray form factors are 
+            // converted to electron scattering factors. Empty otherwise
+            std::vector<double> mottBethe;
+
+            int size() const { return dStarSq.size(); };
+            discamb::Vector3i rotated_index(int entry) const;
+        };
+
+        IamKernel() = default;
+        IamKernel(const discamb::Crystal &crystal, const std::string &table, const std::vector<bool> &tabulated = {});
+
+        // Rebuild the per-atom data and the grouping
+        void update(const std::vector<discamb::AtomInCrystal> &atoms, const std::vector<std::complex<double>> &anomalous);
+
+        Reflections prepare(const std::vector<discamb::Vector3i> &hkl) const;
+        // Store the form factors of the tabulated atoms at one entry, from one value per crystal atom.
+        // A non-empty atoms mask restricts this to the flagged atoms
+        void set_tabulated_form_factors(
+            Reflections &reflections, 
+            int entry, 
+            const std::vector<std::complex<double>> &formFactors,
+            const std::vector<bool> &atoms = {}
+        ) const;
+        const std::vector<int> &tabulated_atoms() const { return mTabulatedAtoms; };
+
+        void f_calc(const Reflections &reflections, std::vector<std::complex<double>> &f) const;
+        void f_calc_and_derivatives(
+            const Reflections &reflections,
+            int hklIdx,
+            std::complex<double> &f,
+            discamb::SfDerivativesAtHkl &derivatives
+        ) const;
+        void d_target_d_params(
+            const Reflections &reflections,
+            const std::vector<std::complex<double>> &d_target_d_f_calc,
+            std::vector<std::complex<double>> &f,
+            std::vector<discamb::TargetFunctionAtomicParamDerivatives> &derivatives
+        ) const;
+
+        // Form factors of one radiation type in a joint evaluation, e.g. from form_factors
+        struct Radiation {
+            const std::vector<double> *formFactors; // In the layout of Reflections::formFactors
+            bool anomalous;                         // Whether the atoms' f' and f'' apply
+        };
+
+        // Form factors of this kernel's scattering types from another table, at the reflections
+        std::vector<double> form_factors(const Reflections &reflections, const std::string &table) const;
+        // Structure factors of one model for several radiation types. The phase and Debye-Waller sums
+        // are evaluated once per atom and reflection, and each radiation applies its own form factors.
+        // Not available with tabulated atoms
+        void f_calc_joint(
+            const Reflections &reflections,
+            const std::vector<Radiation> &radiations,
+            std::vector<std::vector<std::complex<double>>> &f
+        ) const;
+        // Derivatives of the sum of the targets, with dT_r/dF_r for radiation r in d_target_d_f_calc[r]
+        void d_target_d_params_joint(
+            const Reflections &reflections,
+            const std::vector<Radiation> &radiations,
+            const std::vector<std::vector<std::complex<double>>> &d_target_d_f_calc,
+            std::vector<std::vector<std::complex<double>>> &f,
+            std::vector<discamb::TargetFunctionAtomicParamDerivatives> &derivatives
+        ) const;
+
+        // Contributions G_a(h) of the listed atoms with unit form factor and no anomalous terms, including 
+        // the Debye-Waller factor. These only depend on sites, ADPs and occupancies, so any kernel over 
+        // the crystal gives them, e.g. one with all atoms tabulated, which needs no table
+        std::vector<std::vector<std::complex<double>>> unit_contributions(
+            const std::vector<discamb::Vector3i> &hkl,
+            const std::vector<int> &atoms
+        ) const;
+
+        int n_isotropic_groups() const { return mGroups.size(); };
+
+    private:
+        struct IsotropicGroup {
+            int formFactorType;
+            double uIso;
+            std::complex<double> anomalous;
+            std::vector<int> atoms;
+        };
+
+        // Symmetry-summed phase factors of one atom, with the per-operation factors of tabulated 
+        // and anisotropic atoms, and their sums weighted by h and by the ADP monomials
+        struct PhaseSums {
+            std::complex<double> sum;
+            std::complex<double> h[3];
+            std::complex<double> monomials[6];
+        };
+
+        // Contribution of one atom to F, and its derivatives with respect to the atom's parameters
+        struct AtomTerms {
+            std::complex<double> f;
+            std::complex<double> xyz[3];
+            std::complex<double> adp[6];
+            std::complex<double> occupancy;
+        };
+
+        std::vector<SymmetryOperation> mOperations;
+        double mMetric[3][3];
+        std::vector<std::string> mTypeNames;
+        std::vector<GaussianScatteringParameters> mFormFactors;
+
+        // Per atom
+        std::vector<double> mSites;            // 3 per atom, fractional
+        std::vector<double> mWeights;          // occupancy * multiplicity / number of operations
+        std::vector<double> mOccupancyWeights; // multiplicity / number of operations
+        std::vector<int> mFormFactorTypes;
+        std::vector<std::complex<double>> mAnomalous;
+        std::vector<int> mAdpSizes;
+        std::vector<double> mAdps;             // 6 per atom, of which mAdpSizes are used
+        std::vector<int> mAnisotropicIndex;    // Into the anisotropic arrays, -1 for isotropic or tabulated atoms
+        std::vector<int> mTabulatedAtoms;
+        std::vector<int> mTabulatedIndex;      // Into mTabulatedAtoms, -1 for other atoms
+
+        std::vector<IsotropicGroup> mGroups;
+
+        // Anisotropic atoms in structure-of-arrays layout, so the Debye-Waller
+        // exponent vectorises across atoms. Component k of atom a is at k * n + a
+        std::vector<int> mAnisotropicAtoms;
+        std::vector<double> mAnisotropicSites; // x, y, z
+        std::vector<double> mUStar;            // U11, U22, U33, U12, U13, U23
+        // Positions in mAnisotropicAtoms of atoms with nonzero f' or f''. Typically a few heavy atoms, 
+        // so the other atoms are summed with real form factors
+        std::vector<int> mAnomalousAnisotropic;
+
+        std::complex<double> isotropic_scattering(const Reflections &reflections, int hklIdx, const IsotropicGroup &group) const;
+        std::complex<double> anisotropic_scattering(const Reflections &reflections, int hklIdx, int atom) const;
+        void phase_sums(const Reflections &reflections, int hklIdx, int atom, bool derivatives, PhaseSums &sums) const;
+        // Applies the scattering factor to the phase sums. Scattering is double for atoms without 
+        // anomalous terms, or std::complex<double>
+        template<typename Scattering>
+        void atom_terms(
+            const Reflections &reflections,
+            int hklIdx,
+            int atom,
+            const Scattering &scattering,
+            bool derivatives,
+            AtomTerms &terms
+        ) const;
+        // atom_terms with derivatives, taking the real path for atoms without anomalous terms
+        void derivative_terms(
+            const Reflections &reflections,
+            int hklIdx,
+            int atom,
+            const std::complex<double> &scattering,
+            AtomTerms &terms
+        ) const;
+        // Symmetry-summed phase factors of all anisotropic atoms, including the Debye-Waller factor
+        void anisotropic_sums(const Reflections &reflections, int hklIdx, double *real, double *imag) const;
+        void evaluate_form_factors(
+            const std::vector<GaussianScatteringParameters> &parameters,
+            const std::vector<double> &dStarSq,
+            std::vector<double> &formFactors
+        ) const;
+        std::complex<double> radiation_scattering(const Radiation &radiation, int nTypes, int hklIdx, int atom) const;
+};
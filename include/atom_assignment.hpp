@@ -7,6 +7,8 @@
 #include "discamb/AtomTyping/LocalCoordinateSystem.h"
 #include "discamb/AtomTyping/StructureWithDescriptors.h"
 #include "discamb/IO/MATTS_BankReader.h"
+#include "discamb/HC_Model/HC_ModelParameters.h"
+#include "discamb/Scattering/SfCalculator.h"
 
 #include <vector>
 #include <string>
@@ -25,6 +27,75 @@ bool read_bank_and_assign_atoms(
     std::vector<std::string> &lcs_strings
 );
 
+// For each atom, the atoms defining its local coordinate system, including itself.
+// Their positions determine the orientation of the atom's multipoles. With residue_templates,
+// standard residues in polymers labelled as by cctbx (pdb=" CA  TYR A   4 ") are typed once 
+// per residue template instead of per instance, and the other atoms in their surroundings
+std::vector<std::vector<int>> local_coordinate_system_atoms(
+    const std::string bank_filepath,
+    const discamb::Crystal &crystal,
+    bool residue_templates = true
+);
+
+// TAAM types and local coordinate systems of the atoms of a crystal, with the multipole 
+// parameters transferred from the bank, for building a calculator without typing again
+struct TaamModel {
+    std::vector<int> typeIds; // Index of the bank type, -1 for atoms without a type
+    std::vector<std::string> typeLabels; // Bank ID of the type, empty for atoms without a type
+    std::vector<discamb::LocalCoordinateSystem<discamb::AtomInCrystalID>> lcs;
+    discamb::HC_ModelParameters parameters;
+    // Atoms given to the type assigner, counting the surroundings typed with them, and the time taken in seconds
+    int nTypedAtoms = 0;
+    double typingTime = 0.0;
+};
+
+// Types the crystal as local_coordinate_system_atoms does. The valence populations are 
+// scaled to unit_cell_charge if scale is set, as for discamb's "matts" model
+TaamModel assign_taam_model(
+    const std::string bank_filepath,
+    const discamb::Crystal &crystal,
+    double unit_cell_charge = 0.0,
+    bool scale = true,
+    bool residue_templates = true
+);
+
+// The assignment and the multipole parameters, as written by save_TAAM_setup
+nlohmann::json taam_model_json(const TaamModel &model);
+
+// Model from taam_model_json for the same crystal, with its types looked up in bank_filepath. 
+// Nothing is typed, and the saved multipole parameters replace those of the bank
+TaamModel taam_model_from_json(
+    const std::string bank_filepath,
+    const discamb::Crystal &crystal,
+    const nlohmann::json &saved
+);
+
+// Frame atoms of every atom of the model, see local_coordinate_system_atoms
+std::vector<std::vector<int>> taam_frame_atoms(const TaamModel &model);
+
+discamb::SfCalculator *taam_calculator(
+    const discamb::Crystal &crystal, 
+    const TaamModel &model, 
+    bool electron_scattering
+);
+
+// Write the entries of bank_filepath with types assigned to any atom of the crystals to a 
+// smaller bank file. Only assigned types are kept, not those that could match other members 
+// of a compound series. Returns the number of types kept
+int write_assigned_types_bank(
+    const std::string bank_filepath,
+    const std::vector<discamb::Crystal> &crystals,
+    const std::string output_filepath
+);
+
+// Write the entries of bank_filepath with the given type IDs, e.g. those of a TaamModel. 
+// Returns the number of types kept
+int write_bank_entries(
+    const std::string bank_filepath,
+    const std::vector<std::string> &type_ids,
+    const std::string output_filepath
+);
+
 void write_assignment_logs(
     const discamb::Crystal crystal,
     const std::vector<discamb::AtomType> atomTypes,
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "discamb/CrystalStructure/Crystal.h"
+#include "discamb/CrystalStructure/SpaceGroup.h"
+#include "discamb/CrystalStructure/UnitCell.h"
+#include "discamb/MathUtilities/Vector3.h"
+
+#include <utility>
+#include <vector>
+
+// Plain-array form of a space group operation, x' = R x + t in fractional coordinates
+struct SymmetryOperation {
+    int rotation[3][3];
+    double translation[3];
+};
+
+std::vector<SymmetryOperation> symmetry_operations(const discamb::SpaceGroup &spaceGroup);
+
+// Miller index transformed by the operation, h' = h R
+discamb::Vector3i rotate_index(const SymmetryOperation &operation, const discamb::Vector3i &hkl);
+
+// Reciprocal metric tensor G*, such that d*^2 = h^T G* h
+void reciprocal_metric_tensor(const discamb::UnitCell &unitCell, double metric[3][3]);
+
+double d_star_sq(const double metric[3][3], const discamb::Vector3i &hkl);
+
+// Lengths of the direct lattice vectors a, b and c
+discamb::Vector3d lattice_vector_lengths(const discamb::UnitCell &unitCell);
+
+// Pairs of (hydrogen, parent) where the parent is the closest non-hydrogen atom
+// within max_distance, searching lattice translations but not other symmetry operations
+std::vector<std::pair<int, int>> find_hydrogen_parents(const discamb::Crystal &crystal, double max_distance);
+
+// Indices of the selected atoms and of all atoms with a symmetry or lattice image 
+// within radius of a selected atom, in ascending order
+std::vector<int> atoms_near_selection(const discamb::Crystal &crystal, const std::vector<bool> &selection, double radius);
+
+// For each atom, the other atoms with a symmetry or lattice image closer 
+// than the sum of the two atoms' radii, in ascending order
+std::vector<std::vector<int>> neighbour_lists(const discamb::Crystal &crystal, const std::vector<double> &radii);
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "discamb/CrystalStructure/Crystal.h"
+#include "discamb/CrystalStructure/UnitCell.h"
+#include "discamb/MathUtilities/Vector3.h"
+
+#include <vector>
+
+// Enumerate the reflections of the reciprocal space asymmetric unit up to d_min,
+// reproducing the index set and order of cctbx's miller.build_set.
+// Only space groups given in their reference setting are handled.
+// Returns false, leaving hkl empty, if the Laue group or setting is not recognised.
+bool generate_miller_indices(
+    const discamb::Crystal &crystal,
+    const double d_min,
+    const bool anomalous,
+    std::vector<discamb::Vector3i> &hkl
+);
+
+// Stable sort from low to high resolution
+void sort_indices_by_resolution(const discamb::UnitCell &unitCell, std::vector<discamb::Vector3i> &hkl);
@@ -12,5 +12,15 @@ struct GaussianScatteringParameters {
 };
 
 std::map<std::string, GaussianScatteringParameters> get_table(std::string table);
+// The same entries, read from discamb once per process and table, and shared by all callers
+const std::map<std::string, GaussianScatteringParameters> &cached_table(const std::string &table);
+
+// Parameters for a scattering type, falling back to the neutral element if the type is not tabulated. 
+// Returns false if neither is found
+bool find_form_factor(const std::string &type, const std::string &table, GaussianScatteringParameters &parameters);
 
 std::string table_alias(std::string table);
+
+// Bound coherent neutron scattering lengths in fm, as entries with only c, e.g. negative for H 
+// and separate entries for D, T and some isotopes such as Li7 and Ni62. Not known to discamb
+bool is_neutron_table(const std::string &table);
@@ -16,3 +16,5 @@ std::vector<std::complex<double>> f_calc_custom_gaussian_parameters(
     std::vector<std::vector<double>> b,
     std::vector<double> c
 );
+
+std::vector<std::vector<int>> frame_atoms(py::object structure, bool residue_templates);
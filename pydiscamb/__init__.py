@@ -3,6 +3,7 @@ from ._wrapper import (
     get_discamb_version,
     calculate_structure_factors_IAM,
     calculate_structure_factors_TAAM,
+    write_assigned_types_databank,
     DiscambWrapper,
     FCalcMethod,
     get_table,
@@ -15,6 +16,7 @@ __all__ = [
     "get_discamb_version",
     "calculate_structure_factors_IAM",
     "calculate_structure_factors_TAAM",
+    "write_assigned_types_databank",
     "DiscambWrapper",
     "FCalcMethod",
     "get_table",
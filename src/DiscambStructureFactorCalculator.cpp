@@ -1,13 +1,60 @@
 #include "DiscambStructureFactorCalculator.hpp"
 #include "atom_assignment.hpp"
+#include "crystal_geometry.hpp"
 
 #include "discamb/CrystalStructure/StructuralParametersConverter.h"
+#include "discamb/BasicChemistry/periodic_table.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <numeric>
+#include <stdexcept>
+#include <tuple>
 
 #include "assert.hpp"
 
 using namespace discamb;
 using namespace std;
 
+namespace {
+    const double PI = 3.14159265358979323846;
+    const double TWO_PI_SQ = 2.0 * PI * PI;
+
+    double seconds_since(const chrono::steady_clock::time_point &start){
+        return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+
+    // m e^2 / (8 pi^2 epsilon_0 h^2) in Angstrom, for s = sin(theta) / lambda in 1 / Angstrom
+    const double MOTT_BETHE_CONSTANT = 0.023934;
+
+    double nuclear_charge(const string &type){
+        // Strip charge, e.g. O1- -> O. Ions keep the charge of the neutral nucleus
+        string element = type.substr(0, type.find_first_of("0123456789+-"));
+        if (element == "D" || element == "T") return 1.0;
+        int z = periodic_table::atomicNumber(element);
+        assert(z > 0);
+        return z;
+    }
+
+    // f' and f'' are X-ray quantities with no electron counterpart in the Mott-Bethe conversion
+    void assert_no_anomalous(const vector<complex<double>> &anomalous){
+        for (const complex<double> &term : anomalous)
+            assert(term == 0.0);
+    }
+
+    // Hidden reflection sets holding the twin-related indices of a named set
+    const string TWIN_SET_PREFIX = "\x01twinned:";
+
+    bool hidden_set(const string &set_name){
+        return set_name.compare(0, TWIN_SET_PREFIX.size(), TWIN_SET_PREFIX) == 0;
+    }
+
+    // Anomalous terms are resonant X-ray scattering, and are left out for electrons and neutrons
+    bool xray_table(const string &table){
+        return !is_neutron_table(table) && table_alias(table).find("electron") == string::npos;
+    }
+}
 
 vector<vector<complex<double>>> FCalcDerivatives::siteDerivatives() const{
     vector<vector<complex<double>>> out;
@@ -35,25 +82,249 @@ DiscambStructureFactorCalculator::DiscambStructureFactorCalculator(
     assert(mCrystal.atoms.size() > 0);
     assert(mAnomalous.size() > 0);
     assert(mCrystal.atoms.size() == mAnomalous.size());
+    mStats.n_atoms = mCrystal.atoms.size();
+    mMainContribution.assign(mCrystal.atoms.size(), true);
+    mFreeAtoms.resize(mCrystal.atoms.size());
+    iota(mFreeAtoms.begin(), mFreeAtoms.end(), 0);
+    set_derivative_conversion();
     update_calculator();
 }
 
-vector<complex<double>> DiscambStructureFactorCalculator::f_calc(){
+void DiscambStructureFactorCalculator::set_typing_stats(int n_typed_atoms, double typing_time){
+    mStats.n_typed_atoms = n_typed_atoms;
+    mStats.typing_time = typing_time;
+}
+
+void DiscambStructureFactorCalculator::use_iam_kernel(const string &table){
+    assert(mSubsetCalculator == nullptr);
+    mKernel = IamKernel(mCrystal, table);
+    mUseKernel = true;
+    mTabulatedKernel = false;
+    mMottBethe = false;
+    // discamb has no neutron table, so its calculator holds a placeholder table
+    mKernelOnly = is_neutron_table(table);
+    assert(!mKernelOnly || mPruningTolerance == 0.0);
+    mKernelReflections.clear();
+    mRadiationFormFactors.clear();
+    update_kernel();
+}
+
+void DiscambStructureFactorCalculator::use_tabulated_kernel(const vector<vector<int>> &frame_atoms, size_t max_table_bytes, bool mott_bethe){
+    assert(mSubsetCalculator == nullptr);
+    mKernelOnly = mott_bethe;
+    assert(!mKernelOnly || mPruningTolerance == 0.0);
+    assert(frame_atoms.empty() || frame_atoms.size() == mCrystal.atoms.size());
+    for (const vector<int> &frame : frame_atoms)
+        for (int atomIdx : frame)
+            assert(atomIdx >= 0 && atomIdx < mCrystal.atoms.size());
+    // Invert to the frames each atom takes part in, so an update only visits moved atoms
+    mFrameDependents.assign(frame_atoms.empty() ? 0 : mCrystal.atoms.size(), {});
+    for (int i = 0; i < frame_atoms.size(); i++)
+        for (int atomIdx : frame_atoms[i])
+            mFrameDependents[atomIdx].push_back(i);
+    mTabulatedSites.clear();
+    mKernel = IamKernel(mCrystal, "", vector<bool>(mCrystal.atoms.size(), true));
+    mUseKernel = true;
+    mTabulatedKernel = true;
+    mMaxTableBytes = max_table_bytes;
+    mMottBethe = mott_bethe;
+    mNuclearCharges.clear();
+    if (mMottBethe){
+        assert_no_anomalous(mAnomalous);
+        for (const AtomInCrystal &atom : mCrystal.atoms)
+            mNuclearCharges.push_back(nuclear_charge(atom.type));
+    }
+    mKernelReflections.clear();
+    mRadiationFormFactors.clear();
+    update_kernel();
+}
+
+void DiscambStructureFactorCalculator::update_parameters(
+    const vector<AtomInCrystal> &atoms, 
+    const vector<complex<double>> &anomalous
+){
+    assert(atoms.size() == mCrystal.atoms.size());
+    assert(anomalous.size() == mAnomalous.size());
+    for (int i = 0; i < atoms.size(); i++)
+        assert(atoms[i].type == mCrystal.atoms[i].type);
+    if (mMottBethe)
+        assert_no_anomalous(anomalous);
+    mCrystal.atoms = atoms;
+    mAnomalous = anomalous;
+    apply_riding_constraints();
     update_calculator();
+    update_kernel();
+}
+
+void DiscambStructureFactorCalculator::set_pruning(double tolerance, int n_shells){
+    assert(tolerance >= 0.0);
+    assert(n_shells > 0);
+    assert(tolerance == 0.0 || !mKernelOnly);
+    mPruningTolerance = tolerance;
+    mPruningShells = n_shells;
+    mStats.pruned_fraction = 0.0;
+    mStats.pruning_error_bound = 0.0;
+}
+
+vector<complex<double>> DiscambStructureFactorCalculator::f_calc(const string &set_name){
+    auto start = chrono::steady_clock::now();
+    update_calculator();
+    const vector<Vector3i> &indices = reflection_set(set_name);
     vector<complex<double>> sf;
-    sf.resize(hkl.size());
-    vector<bool> count_atom_contribution (mCrystal.atoms.size(), true);
-    mCalculator->calculateStructureFactors(mCrystal.atoms, hkl, sf, count_atom_contribution);
+    sf.resize(indices.size());
+    if (mPruningTolerance > 0.0){
+        f_calc_pruned(indices, sf);
+    }
+    else if (mUseKernel){
+        mKernel.f_calc(kernel_reflections(set_name), sf);
+    }
+    else {
+        mCalculator->calculateStructureFactors(mCrystal.atoms, indices, sf, mMainContribution);
+    }
+    add_subset_f_calc(indices, sf);
+    mStats.f_calc_time = seconds_since(start);
     return sf;
 }
 
-vector<FCalcDerivatives> DiscambStructureFactorCalculator::d_f_calc_d_params(){
+void DiscambStructureFactorCalculator::f_calc_pruned(const vector<Vector3i> &indices, vector<complex<double>> &sf){
+    // The contribution of an atom to any reflection is bounded by
+    // occupancy * multiplicity * |f + f' + i f''| * exp(-2 pi^2 u_min d*^2),
+    // with u_min the smallest mean-square displacement in any direction. Both factors
+    // decrease with resolution, so the bound at the lowest-resolution reflection holds
+    // for the whole shell. For TAAM the form factor at that one reflection is an estimate
+    const int nHkl = indices.size();
+    const int nAtoms = mCrystal.atoms.size();
+    sf.assign(nHkl, 0.0);
+    if (nHkl == 0) return;
+
+    double metric[3][3];
+    reciprocal_metric_tensor(mCrystal.unitCell, metric);
+    vector<double> dStarSq (nHkl);
+    for (int i = 0; i < nHkl; i++)
+        dStarSq[i] = d_star_sq(metric, indices[i]);
+    vector<int> order (nHkl);
+    iota(order.begin(), order.end(), 0);
+    stable_sort(order.begin(), order.end(), [&](int a, int b){ return dStarSq[a] < dStarSq[b]; });
+    vector<double> uMin = minimum_mean_square_displacements();
+
+    const int nShells = min(mPruningShells, nHkl);
+    const vector<bool> allAtoms (nAtoms, true);
+    vector<bool> count_atom_contribution (nAtoms);
+    vector<complex<double>> formFactors;
+    vector<Vector3i> shellIndices;
+    vector<complex<double>> shellSf;
+    long skipped = 0;
+    double errorBound = 0.0;
+    for (int shell = 0; shell < nShells; shell++){
+        const int start = shell * nHkl / nShells;
+        const int end = (shell + 1) * nHkl / nShells;
+        const int lowest = order[start];
+        mCalculator->calculateFormFactors(indices[lowest], formFactors, allAtoms);
+
+        double shellError = 0.0;
+        for (int atomIdx = 0; atomIdx < nAtoms; atomIdx++){
+            const AtomInCrystal &atom = mCrystal.atoms[atomIdx];
+            double bound = 
+                abs(atom.occupancy) * atom.multiplicity * 
+                (abs(formFactors[atomIdx]) + abs(mAnomalous[atomIdx])) * 
+                exp(-TWO_PI_SQ * uMin[atomIdx] * dStarSq[lowest]);
+            count_atom_contribution[atomIdx] = mMainContribution[atomIdx] && bound >= mPruningTolerance;
+            if (mMainContribution[atomIdx] && !count_atom_contribution[atomIdx]){
+                shellError += bound;
+                skipped += end - start;
+            }
+        }
+        errorBound = max(errorBound, shellError);
+
+        shellIndices.resize(end - start);
+        for (int i = start; i < end; i++)
+            shellIndices[i - start] = indices[order[i]];
+        shellSf.assign(end - start, 0.0);
+        mCalculator->calculateStructureFactors(mCrystal.atoms, shellIndices, shellSf, count_atom_contribution);
+        for (int i = start; i < end; i++)
+            sf[order[i]] = shellSf[i - start];
+    }
+    mStats.pruned_fraction = static_cast<double>(skipped) / (static_cast<double>(nHkl) * nAtoms);
+    mStats.pruning_error_bound = errorBound;
+}
+
+vector<double> DiscambStructureFactorCalculator::minimum_mean_square_displacements() const{
+    // Anisotropic atoms use a Gershgorin lower bound of the smallest eigenvalue of U_cart
+    vector<double> out (mCrystal.atoms.size(), 0.0);
+    vector<double> uCart;
+    for (int i = 0; i < out.size(); i++){
+        const vector<double> &adp = mCrystal.atoms[i].adp;
+        if (adp.size() == 1){
+            out[i] = max(adp[0], 0.0);
+        }
+        else if (adp.size() == 6){
+            mConverter.convertADP(
+                adp, uCart, 
+                mCrystal.adpConvention, 
+                structural_parameters_convention::AdpConvention::U_cart
+            );
+            double lower = min({
+                uCart[0] - abs(uCart[3]) - abs(uCart[4]),
+                uCart[1] - abs(uCart[3]) - abs(uCart[5]),
+                uCart[2] - abs(uCart[4]) - abs(uCart[5])
+            });
+            out[i] = max(lower, 0.0);
+        }
+    }
+    return out;
+}
+
+vector<FCalcDerivatives> DiscambStructureFactorCalculator::d_f_calc_d_params(const string &set_name){
+    if (mUseKernel){
+        auto start = chrono::steady_clock::now();
+        const vector<Vector3i> &indices = reflection_set(set_name);
+        const IamKernel::Reflections &reflections = kernel_reflections(set_name);
+        vector<FCalcDerivatives> out (indices.size());
+        #pragma omp parallel for
+        for (int i = 0; i < indices.size(); i++){
+            out[i].hkl = {indices[i].x, indices[i].y, indices[i].z};
+            mKernel.f_calc_and_derivatives(reflections, i, out[i].structure_factor, out[i]);
+            constrain_derivatives(out[i]);
+        }
+        mStats.derivatives_time = seconds_since(start);
+        return out;
+    }
+    return d_f_calc_d_params(reflection_set(set_name));
+}
+
+vector<FCalcDerivatives> DiscambStructureFactorCalculator::d_f_calc_d_params(const vector<Vector3i> &indices){
+    // Set up once for the whole batch, instead of per reflection as in d_f_calc_hkl_d_params.
+    // The reflections are evaluated in order, since the discamb calculator
+    // keeps per-call working buffers and is not safe to share between threads
+    auto start = chrono::steady_clock::now();
+    update_calculator();
     vector<FCalcDerivatives> out;
-    out.resize(hkl.size());
+    out.resize(indices.size());
 
-    for (int i = 0; i < hkl.size(); i++){
-        out[i] = d_f_calc_hkl_d_params(hkl[i].x, hkl[i].y, hkl[i].z);
+    if (mUseKernel){
+        IamKernel::Reflections reflections = prepare_kernel_reflections(indices);
+        #pragma omp parallel for
+        for (int i = 0; i < indices.size(); i++){
+            out[i].hkl = {indices[i].x, indices[i].y, indices[i].z};
+            mKernel.f_calc_and_derivatives(reflections, i, out[i].structure_factor, out[i]);
+            constrain_derivatives(out[i]);
+        }
     }
+    else {
+        // Serial, since the discamb calculator keeps per-call state
+        for (int i = 0; i < indices.size(); i++){
+            out[i].hkl = {indices[i].x, indices[i].y, indices[i].z};
+            mCalculator->calculateStructureFactorsAndDerivatives(
+                out[i].hkl,
+                out[i].structure_factor,
+                out[i],
+                mMainContribution
+            );
+            add_subset_derivatives(indices[i], out[i].structure_factor, out[i]);
+            constrain_derivatives(out[i]);
+        }
+    }
+    mStats.derivatives_time = seconds_since(start);
     return out;
 }
 
@@ -61,65 +332,653 @@ FCalcDerivatives DiscambStructureFactorCalculator::d_f_calc_hkl_d_params(int h,
     update_calculator();
     FCalcDerivatives out;
     out.hkl = {h, k, l};
-    vector<bool> count_atom_contribution (mCrystal.atoms.size(), true);
+    if (mUseKernel){
+        mKernel.f_calc_and_derivatives(prepare_kernel_reflections({Vector3i {h, k, l}}), 0, out.structure_factor, out);
+        constrain_derivatives(out);
+        return out;
+    }
     mCalculator->calculateStructureFactorsAndDerivatives(
             out.hkl,
             out.structure_factor,
             out,
-            count_atom_contribution
+            mMainContribution
         );
+    add_subset_derivatives(Vector3i {h, k, l}, out.structure_factor, out);
+    constrain_derivatives(out);
     return out;
 }
 
-vector<TargetFunctionAtomicParamDerivatives> DiscambStructureFactorCalculator::d_target_d_params(vector<complex<double>> d_target_d_f_calc){
+vector<vector<complex<double>>> DiscambStructureFactorCalculator::f_calc_anomalous_sets(
+    const vector<vector<complex<double>>> &anomalous_sets,
+    const string &set_name
+){
+    const int nAtoms = mCrystal.atoms.size();
+    const int nSets = anomalous_sets.size();
+    for (const vector<complex<double>> &anomalous : anomalous_sets){
+        assert(anomalous.size() == nAtoms);
+        if (mMottBethe)
+            assert_no_anomalous(anomalous);
+    }
+    const vector<Vector3i> &indices = reflection_set(set_name);
+    const int nHkl = indices.size();
+
+    // The anomalous terms enter linearly, F_k = F_0 + sum_a (f'_ka + i f''_ka) G_a,
+    // where F_0 has no anomalous terms and G_a is the contribution of atom a with unit form factor.
+    // G_a is only needed for atoms with nonzero terms in some set or in the current model, 
+    // and is summed directly from the sites and ADPs in one pass for all of them
+    vector<int> anomalousAtoms;
+    for (int atomIdx = 0; atomIdx < nAtoms; atomIdx++){
+        bool anomalous = mAnomalous[atomIdx] != 0.0;
+        for (int setIdx = 0; !anomalous && setIdx < nSets; setIdx++)
+            anomalous = anomalous_sets[setIdx][atomIdx] != 0.0;
+        if (anomalous)
+            anomalousAtoms.push_back(atomIdx);
+    }
+    vector<vector<complex<double>>> geometric;
+    if (mUseKernel){
+        geometric = mKernel.unit_contributions(indices, anomalousAtoms);
+    }
+    else {
+        IamKernel geometry (mCrystal, "", vector<bool>(nAtoms, true));
+        geometry.update(mCrystal.atoms, mAnomalous);
+        geometric = geometry.unit_contributions(indices, anomalousAtoms);
+    }
+
+    // F_0 from one evaluation of the current model, without its own anomalous terms
     update_calculator();
-    assert(hkl.size() == d_target_d_f_calc.size());
+    vector<complex<double>> f_0 (nHkl);
+    if (mUseKernel){
+        mKernel.f_calc(kernel_reflections(set_name), f_0);
+    }
+    else {
+        mCalculator->calculateStructureFactors(mCrystal.atoms, indices, f_0, mMainContribution);
+        add_subset_f_calc(indices, f_0);
+    }
+    #pragma omp parallel for
+    for (int hklIdx = 0; hklIdx < nHkl; hklIdx++)
+        for (int i = 0; i < anomalousAtoms.size(); i++)
+            f_0[hklIdx] -= mAnomalous[anomalousAtoms[i]] * geometric[i][hklIdx];
+
+    vector<vector<complex<double>>> out (nSets, f_0);
+    for (int setIdx = 0; setIdx < nSets; setIdx++){
+        #pragma omp parallel for
+        for (int hklIdx = 0; hklIdx < nHkl; hklIdx++){
+            for (int i = 0; i < anomalousAtoms.size(); i++)
+                out[setIdx][hklIdx] += anomalous_sets[setIdx][anomalousAtoms[i]] * geometric[i][hklIdx];
+        }
+    }
+    return out;
+}
+
+vector<TargetFunctionAtomicParamDerivatives> DiscambStructureFactorCalculator::d_target_d_params(
+    vector<complex<double>> d_target_d_f_calc, 
+    const string &set_name
+){
+    auto start = chrono::steady_clock::now();
+    update_calculator();
+    const vector<Vector3i> &indices = reflection_set(set_name);
+    assert(indices.size() == d_target_d_f_calc.size());
     vector<complex<double>> sf;
     vector<TargetFunctionAtomicParamDerivatives> out;
     out.resize(mCrystal.atoms.size());
-    vector<bool> count_atom_contribution( mCrystal.atoms.size(), true );
 
-    mCalculator->calculateStructureFactorsAndDerivatives(
-        mCrystal.atoms,
-        hkl,
-        sf,
-        out,
-        d_target_d_f_calc,
-        count_atom_contribution
-    );
+    if (mUseKernel){
+        mKernel.d_target_d_params(kernel_reflections(set_name), d_target_d_f_calc, sf, out);
+    }
+    else {
+        mCalculator->calculateStructureFactorsAndDerivatives(
+            mCrystal.atoms,
+            indices,
+            sf,
+            out,
+            d_target_d_f_calc,
+            mMainContribution
+        );
+        add_subset_target_derivatives(indices, d_target_d_f_calc, out);
+    }
 
     // Ensure correct convention (U_cart and Cartesian)
+    convert_derivatives(out);
+    constrain_derivatives(out);
+    mStats.derivatives_time = seconds_since(start);
+    return out;
+}
+
+vector<IamKernel::Radiation> DiscambStructureFactorCalculator::radiations(const vector<string> &tables, const string &set_name){
+    assert(mUseKernel && !mTabulatedKernel);
+    const IamKernel::Reflections &reflections = kernel_reflections(set_name);
+    map<string, vector<double>> &formFactors = mRadiationFormFactors[set_name];
+    vector<IamKernel::Radiation> out;
+    for (const string &table : tables){
+        auto found = formFactors.find(table);
+        if (found == formFactors.end())
+            found = formFactors.emplace(table, mKernel.form_factors(reflections, table)).first;
+        out.push_back(IamKernel::Radiation {&found->second, xray_table(table)});
+    }
+    return out;
+}
+
+vector<vector<complex<double>>> DiscambStructureFactorCalculator::f_calc_joint(const vector<string> &tables, const string &set_name){
+    auto start = chrono::steady_clock::now();
+    vector<IamKernel::Radiation> radiationFormFactors = radiations(tables, set_name);
+    vector<vector<complex<double>>> out;
+    mKernel.f_calc_joint(kernel_reflections(set_name), radiationFormFactors, out);
+    mStats.f_calc_time = seconds_since(start);
+    return out;
+}
+
+vector<TargetFunctionAtomicParamDerivatives> DiscambStructureFactorCalculator::d_target_d_params_joint(
+    const vector<string> &tables,
+    vector<vector<complex<double>>> d_target_d_f_calc,
+    const vector<double> &weights,
+    const string &set_name
+){
+    auto start = chrono::steady_clock::now();
+    assert(d_target_d_f_calc.size() == tables.size());
+    assert(weights.empty() || weights.size() == tables.size());
+    // The weights enter linearly, sum_r w_r dT_r/dp
+    if (!weights.empty())
+        for (int r = 0; r < tables.size(); r++)
+            for (complex<double> &d : d_target_d_f_calc[r])
+                d *= weights[r];
+
+    vector<IamKernel::Radiation> radiationFormFactors = radiations(tables, set_name);
+    vector<vector<complex<double>>> sf;
+    vector<TargetFunctionAtomicParamDerivatives> out;
+    mKernel.d_target_d_params_joint(kernel_reflections(set_name), radiationFormFactors, d_target_d_f_calc, sf, out);
+
+    convert_derivatives(out);
+    constrain_derivatives(out);
+    mStats.derivatives_time = seconds_since(start);
+    return out;
+}
+
+string DiscambStructureFactorCalculator::twinned_set(
+    const vector<vector<vector<int>>> &twin_laws,
+    const string &set_name,
+    vector<int> &unionIndex
+){
+    assert(!twin_laws.empty());
+    for (const vector<vector<int>> &law : twin_laws){
+        assert(law.size() == 3);
+        for (const vector<int> &row : law)
+            assert(row.size() == 3);
+    }
+    const vector<Vector3i> &indices = reflection_set(set_name);
+    const int nLaws = twin_laws.size();
+
+    // Unique indices in order of first appearance, so the set is stable between calls
+    map<tuple<int, int, int>, int> positions;
+    vector<Vector3i> twinned;
+    unionIndex.resize(indices.size() * nLaws);
+    for (int i = 0; i < indices.size(); i++){
+        for (int k = 0; k < nLaws; k++){
+            // h R_k, with h as a row vector as for symmetry operations
+            int related[3];
+            for (int j = 0; j < 3; j++)
+                related[j] = 
+                    indices[i][0] * twin_laws[k][0][j] + 
+                    indices[i][1] * twin_laws[k][1][j] + 
+                    indices[i][2] * twin_laws[k][2][j];
+            auto key = make_tuple(related[0], related[1], related[2]);
+            auto found = positions.find(key);
+            if (found == positions.end()){
+                found = positions.emplace(key, twinned.size()).first;
+                twinned.push_back(Vector3i {related[0], related[1], related[2]});
+            }
+            unionIndex[i * nLaws + k] = found->second;
+        }
+    }
+
+    // Replacing the set drops its kernel data, so it is only replaced when the indices change
+    const string name = TWIN_SET_PREFIX + set_name;
+    auto existing = mReflectionSets.find(name);
+    bool changed = existing == mReflectionSets.end() || existing->second.size() != twinned.size();
+    for (int i = 0; !changed && i < twinned.size(); i++)
+        for (int j = 0; j < 3; j++)
+            changed = changed || existing->second[i][j] != twinned[i][j];
+    if (changed)
+        set_reflection_set(name, twinned);
+    return name;
+}
+
+vector<double> DiscambStructureFactorCalculator::i_calc_twinned(
+    const vector<vector<vector<int>>> &twin_laws,
+    const vector<double> &fractions,
+    const string &set_name
+){
+    assert(fractions.size() == twin_laws.size());
+    vector<int> unionIndex;
+    vector<complex<double>> f = f_calc(twinned_set(twin_laws, set_name, unionIndex));
+    const int nLaws = twin_laws.size();
+    vector<double> out (unionIndex.size() / nLaws, 0.0);
+    for (int i = 0; i < out.size(); i++)
+        for (int k = 0; k < nLaws; k++)
+            out[i] += fractions[k] * norm(f[unionIndex[i * nLaws + k]]);
+    return out;
+}
+
+vector<TargetFunctionAtomicParamDerivatives> DiscambStructureFactorCalculator::d_target_d_params_twinned(
+    const vector<vector<vector<int>>> &twin_laws,
+    const vector<double> &fractions,
+    const vector<double> &d_target_d_i_calc,
+    vector<double> &d_target_d_fractions,
+    const string &set_name
+){
+    assert(fractions.size() == twin_laws.size());
+    assert(d_target_d_i_calc.size() == reflection_set(set_name).size());
+    vector<int> unionIndex;
+    const string name = twinned_set(twin_laws, set_name, unionIndex);
+    vector<complex<double>> f = f_calc(name);
+    const int nLaws = twin_laws.size();
+
+    // I(h) = sum_k a_k |F_k|^2, so dT/dp = sum_h dT/dI(h) sum_k a_k 2 Re(conj(F_k) dF_k/dp), which is 
+    // d_target_d_params on the twin-related indices with dT/dF = sum over (h, k) mapping to them of 2 a_k dT/dI(h) F
+    vector<complex<double>> d_target_d_f_calc (f.size(), 0.0);
+    d_target_d_fractions.assign(nLaws, 0.0);
+    for (int i = 0; i < d_target_d_i_calc.size(); i++){
+        for (int k = 0; k < nLaws; k++){
+            const int u = unionIndex[i * nLaws + k];
+            d_target_d_f_calc[u] += 2.0 * fractions[k] * d_target_d_i_calc[i] * f[u];
+            d_target_d_fractions[k] += d_target_d_i_calc[i] * norm(f[u]);
+        }
+    }
+    return d_target_d_params(d_target_d_f_calc, name);
+}
+
+void DiscambStructureFactorCalculator::set_reflection_set(const string &set_name, vector<Vector3i> indices){
+    mKernelReflections.erase(set_name);
+    mRadiationFormFactors.erase(set_name);
+    if (set_name.empty())
+        hkl.swap(indices);
+    else
+        mReflectionSets[set_name].swap(indices);
+}
+
+void DiscambStructureFactorCalculator::remove_reflection_set(const string &set_name){
+    if (!hidden_set(set_name) && mReflectionSets.count(TWIN_SET_PREFIX + set_name))
+        remove_reflection_set(TWIN_SET_PREFIX + set_name);
+    mKernelReflections.erase(set_name);
+    mRadiationFormFactors.erase(set_name);
+    if (set_name.empty())
+        hkl.clear();
+    else
+        mReflectionSets.erase(set_name);
+}
+
+const vector<Vector3i> &DiscambStructureFactorCalculator::reflection_set(const string &set_name) const{
+    if (set_name.empty()) return hkl;
+    auto found = mReflectionSets.find(set_name);
+    if (found == mReflectionSets.end())
+        throw out_of_range("No reflection set named '" + set_name + "'");
+    return found->second;
+}
+
+const IamKernel::Reflections &DiscambStructureFactorCalculator::kernel_reflections(const string &set_name){
+    auto found = mKernelReflections.find(set_name);
+    if (found != mKernelReflections.end()) return found->second;
+    return mKernelReflections[set_name] = prepare_kernel_reflections(reflection_set(set_name));
+}
+
+IamKernel::Reflections DiscambStructureFactorCalculator::prepare_kernel_reflections(const vector<Vector3i> &indices){
+    IamKernel::Reflections out = mKernel.prepare(indices);
+    const int nTabulated = mKernel.tabulated_atoms().size();
+    if (nTabulated == 0) return out;
+
+    const size_t nEntries = static_cast<size_t>(out.size()) * out.nOperations;
+    const size_t tableBytes = nEntries * nTabulated * sizeof(complex<double>);
+    if (tableBytes > mMaxTableBytes)
+        throw length_error(
+            "Form factor table of " + to_string(tableBytes) + " bytes exceeds the limit of " + 
+            to_string(mMaxTableBytes) + " bytes. Raise max_table_bytes, or split the reflections into smaller sets"
+        );
+
+    if (mMottBethe){
+        // s^2 = d*^2 / 4
+        out.mottBethe.resize(out.size());
+        for (int i = 0; i < out.size(); i++){
+            if (out.dStarSq[i] == 0.0)
+                throw domain_error("The Mott-Bethe formula is undefined at hkl = 0");
+            out.mottBethe[i] = 4.0 * MOTT_BETHE_CONSTANT / out.dStarSq[i];
+        }
+    }
+    tabulate_form_factors(out, vector<bool>(mCrystal.atoms.size(), true));
+    return out;
+}
+
+void DiscambStructureFactorCalculator::tabulate_form_factors(IamKernel::Reflections &reflections, const vector<bool> &atoms){
+    // The kernel adds the anomalous terms itself
+    mCalculator->setAnomalous(vector<complex<double>>(mCrystal.atoms.size(), 0.0));
+    const size_t nEntries = static_cast<size_t>(reflections.size()) * reflections.nOperations;
+    const size_t chunkSize = 4096;
+    vector<Vector3i> rotated;
+    vector<vector<complex<double>>> formFactors;
+    for (size_t chunkStart = 0; chunkStart < nEntries; chunkStart += chunkSize){
+        const size_t chunkEnd = min(nEntries, chunkStart + chunkSize);
+        rotated.resize(chunkEnd - chunkStart);
+        for (size_t entry = chunkStart; entry < chunkEnd; entry++)
+            rotated[entry - chunkStart] = reflections.rotated_index(entry);
+        mCalculator->calculateFormFactors(rotated, formFactors, atoms);
+        for (size_t entry = chunkStart; entry < chunkEnd; entry++){
+            vector<complex<double>> &entryFormFactors = formFactors[entry - chunkStart];
+            if (mMottBethe){
+                const double factor = reflections.mottBethe[entry / reflections.nOperations];
+                for (int atomIdx = 0; atomIdx < entryFormFactors.size(); atomIdx++)
+                    entryFormFactors[atomIdx] = factor * (mNuclearCharges[atomIdx] - entryFormFactors[atomIdx]);
+            }
+            mKernel.set_tabulated_form_factors(reflections, entry, entryFormFactors, atoms);
+        }
+    }
+    update_calculator();
+}
+
+void DiscambStructureFactorCalculator::update_tabulated_form_factors(){
+    // Form factors follow the atoms' local coordinate systems, so those of atoms 
+    // with a moved frame atom are redone in every cached set. ADP and occupancy 
+    // changes do not enter the form factors and leave the tables, and mCalculator, as they are
+    const int nAtoms = mCrystal.atoms.size();
+    mStats.n_frames_updated = 0;
+    if (mTabulatedSites.empty()){
+        // Tables built from here on use the current sites
+        for (const AtomInCrystal &atom : mCrystal.atoms)
+            for (int k = 0; k < 3; k++)
+                mTabulatedSites.push_back(atom.coordinates[k]);
+        mCalculator->update(mCrystal.atoms);
+        return;
+    }
+
+    vector<int> moved;
+    for (int i = 0; i < nAtoms; i++){
+        bool atomMoved = false;
+        for (int k = 0; k < 3; k++){
+            atomMoved = atomMoved || mTabulatedSites[3 * i + k] != mCrystal.atoms[i].coordinates[k];
+            mTabulatedSites[3 * i + k] = mCrystal.atoms[i].coordinates[k];
+        }
+        if (atomMoved) moved.push_back(i);
+    }
+    if (moved.empty()) return;
+
+    // Without frame atoms, any move invalidates all atoms
+    vector<bool> stale (nAtoms, mFrameDependents.empty());
+    if (!mFrameDependents.empty())
+        for (int atomIdx : moved)
+            for (int frame : mFrameDependents[atomIdx])
+                stale[frame] = true;
+    mStats.n_frames_updated = count(stale.begin(), stale.end(), true);
+
+    mCalculator->update(mCrystal.atoms);
+    for (auto &set : mKernelReflections)
+        tabulate_form_factors(set.second, stale);
+}
+
+vector<string> DiscambStructureFactorCalculator::reflection_set_names() const{
+    vector<string> out;
+    for (const auto &named_set : mReflectionSets)
+        if (!hidden_set(named_set.first))
+            out.push_back(named_set.first);
+    return out;
+}
+
+void DiscambStructureFactorCalculator::set_derivative_conversion(){
+    // The conversions are linear, so the maps are found by converting unit vectors
     structural_parameters_convention::AdpConvention ac = mCrystal.adpConvention;
     structural_parameters_convention::XyzCoordinateSystem xyzc = mCrystal.xyzCoordinateSystem;
 
-    int idx, nAtoms = out.size();
+    int i, j;
     vector<complex<double> > adpIn(6), adpOut(6);
+    for (j = 0; j < 6; j++){
+        for (i = 0; i < 6; i++)
+            adpIn[i] = (i == j) ? 1.0 : 0.0;
+        mConverter.convertDerivativesADP(adpIn, adpOut, ac, structural_parameters_convention::AdpConvention::U_cart);
+        for (i = 0; i < 6; i++)
+            mAdpDerivativeConversion[i][j] = adpOut[i].real();
+    }
+
+    // U_eq is a third of the trace of U_cart
+    vector<double> adp(6), uCart;
+    for (j = 0; j < 6; j++){
+        for (i = 0; i < 6; i++)
+            adp[i] = (i == j) ? 1.0 : 0.0;
+        mConverter.convertADP(adp, uCart, ac, structural_parameters_convention::AdpConvention::U_cart);
+        mUeqFromAdp[j] = (uCart[0] + uCart[1] + uCart[2]) / 3.0;
+    }
+
     Vector3<complex<double> > xyzIn, xyzOut;
-    int i;
-    // ADPs
+    for (j = 0; j < 3; j++){
+        for (i = 0; i < 3; i++)
+            xyzIn[i] = (i == j) ? 1.0 : 0.0;
+        mConverter.convertDerivativesXyz(xyzIn, xyzOut, xyzc, structural_parameters_convention::XyzCoordinateSystem::cartesian);
+        for (i = 0; i < 3; i++)
+            mXyzDerivativeConversion[i][j] = xyzOut[i].real();
+    }
+}
+
+void DiscambStructureFactorCalculator::convert_derivatives(vector<TargetFunctionAtomicParamDerivatives> &derivatives) const{
+    // Gather into a contiguous (nAtoms x 9) block of xyz followed by ADP derivatives, 
+    // apply the block-diagonal map, and scatter back
+    const int nAtoms = derivatives.size();
+    vector<double> block(9 * nAtoms, 0.0);
+    vector<double> converted(9 * nAtoms, 0.0);
+    int idx, i, j;
     for (idx = 0; idx < nAtoms; idx++){
-        if (out[idx].adp_derivatives.size() == 6){
+        double *row = &block[9 * idx];
+        for (i = 0; i < 3; i++)
+            row[i] = derivatives[idx].atomic_position_derivatives[i];
+        if (derivatives[idx].adp_derivatives.size() == 6)
             for (i = 0; i < 6; i++)
-                adpIn[i] = out[idx].adp_derivatives[i];
-            mConverter.convertDerivativesADP(adpIn, adpOut, ac, structural_parameters_convention::AdpConvention::U_cart);
-            for (i = 0; i<6; i++)
-                out[idx].adp_derivatives[i] = adpOut[i].real();
-        }
+                row[3 + i] = derivatives[idx].adp_derivatives[i];
     }
-    // Coordinates
-    for (idx = 0; idx<nAtoms; idx++){
+
+    #pragma omp parallel for private(i, j)
+    for (idx = 0; idx < nAtoms; idx++){
+        const double *in = &block[9 * idx];
+        double *out = &converted[9 * idx];
         for (i = 0; i < 3; i++)
-            xyzIn[i] = out[idx].atomic_position_derivatives[i];
-        mConverter.convertDerivativesXyz(xyzIn, xyzOut, xyzc,  structural_parameters_convention::XyzCoordinateSystem::cartesian);
+            for (j = 0; j < 3; j++)
+                out[i] += mXyzDerivativeConversion[i][j] * in[j];
+        for (i = 0; i < 6; i++)
+            for (j = 0; j < 6; j++)
+                out[3 + i] += mAdpDerivativeConversion[i][j] * in[3 + j];
+    }
+
+    for (idx = 0; idx < nAtoms; idx++){
+        const double *row = &converted[9 * idx];
         for (i = 0; i < 3; i++)
-            out[idx].atomic_position_derivatives[i] = xyzOut[i].real();
+            derivatives[idx].atomic_position_derivatives[i] = row[i];
+        if (derivatives[idx].adp_derivatives.size() == 6)
+            for (i = 0; i < 6; i++)
+                derivatives[idx].adp_derivatives[i] = row[3 + i];
+    }
+}
+
+void DiscambStructureFactorCalculator::set_riding_atoms(const vector<pair<int, int>> &riding_pairs, double u_iso_factor){
+    const int nAtoms = mCrystal.atoms.size();
+    vector<bool> riding (nAtoms, false);
+    mRidingAtoms.clear();
+    for (const pair<int, int> &riding_pair : riding_pairs){
+        const int atom = riding_pair.first;
+        const int parent = riding_pair.second;
+        assert(atom >= 0 && atom < nAtoms);
+        assert(parent >= 0 && parent < nAtoms);
+        assert(!riding[atom]);
+        assert(mCrystal.atoms[atom].adp.size() == 1);
+        riding[atom] = true;
+        Vector3d offset;
+        for (int k = 0; k < 3; k++)
+            offset[k] = mCrystal.atoms[atom].coordinates[k] - mCrystal.atoms[parent].coordinates[k];
+        mRidingAtoms.push_back(RidingAtom {atom, parent, offset, u_iso_factor});
     }
-    
+    // Parents must have their own parameters, so a single pass of the chain rule suffices
+    for (const RidingAtom &r : mRidingAtoms)
+        assert(!riding[r.parent]);
+
+    mFreeAtoms.clear();
+    for (int i = 0; i < nAtoms; i++)
+        if (!riding[i]) mFreeAtoms.push_back(i);
+
+    apply_riding_constraints();
+    update_calculator();
+    update_kernel();
+}
+
+void DiscambStructureFactorCalculator::apply_riding_constraints(){
+    for (const RidingAtom &r : mRidingAtoms){
+        AtomInCrystal &atom = mCrystal.atoms[r.atom];
+        const AtomInCrystal &parent = mCrystal.atoms[r.parent];
+        for (int k = 0; k < 3; k++)
+            atom.coordinates[k] = parent.coordinates[k] + r.offset[k];
+
+        double uEq = 0.0;
+        if (parent.adp.size() == 1)
+            uEq = parent.adp[0];
+        else if (parent.adp.size() == 6)
+            for (int k = 0; k < 6; k++)
+                uEq += mUeqFromAdp[k] * parent.adp[k];
+        atom.adp.assign(1, r.uIsoFactor * uEq);
+        atom.occupancy = parent.occupancy;
+    }
+}
+
+void DiscambStructureFactorCalculator::constrain_derivatives(vector<TargetFunctionAtomicParamDerivatives> &derivatives) const{
+    if (mRidingAtoms.empty()) return;
+    for (const RidingAtom &r : mRidingAtoms){
+        const TargetFunctionAtomicParamDerivatives &atom = derivatives[r.atom];
+        TargetFunctionAtomicParamDerivatives &parent = derivatives[r.parent];
+        for (int k = 0; k < 3; k++)
+            parent.atomic_position_derivatives[k] += atom.atomic_position_derivatives[k];
+        const double dU = r.uIsoFactor * atom.adp_derivatives[0];
+        if (parent.adp_derivatives.size() == 1)
+            parent.adp_derivatives[0] += dU;
+        else
+            for (int k = 0; k < 3; k++)
+                parent.adp_derivatives[k] += dU / 3.0;
+        parent.occupancy_derivatives += atom.occupancy_derivatives;
+    }
+    vector<TargetFunctionAtomicParamDerivatives> out;
+    out.reserve(mFreeAtoms.size());
+    for (int i : mFreeAtoms)
+        out.push_back(derivatives[i]);
+    derivatives.swap(out);
+}
+
+void DiscambStructureFactorCalculator::constrain_derivatives(SfDerivativesAtHkl &derivatives) const{
+    if (mRidingAtoms.empty()) return;
+    for (const RidingAtom &r : mRidingAtoms){
+        for (int k = 0; k < 3; k++)
+            derivatives.atomicPostionDerivatives[r.parent][k] += derivatives.atomicPostionDerivatives[r.atom][k];
+        const complex<double> dU = r.uIsoFactor * derivatives.adpDerivatives[r.atom][0];
+        vector<complex<double>> &parentAdp = derivatives.adpDerivatives[r.parent];
+        if (parentAdp.size() == 1)
+            parentAdp[0] += dU;
+        else
+            for (int k = 0; k < 6; k++)
+                parentAdp[k] += dU * mUeqFromAdp[k];
+        derivatives.occupancyDerivatives[r.parent] += derivatives.occupancyDerivatives[r.atom];
+    }
+    SfDerivativesAtHkl out;
+    for (int i : mFreeAtoms){
+        out.atomicPostionDerivatives.push_back(derivatives.atomicPostionDerivatives[i]);
+        out.adpDerivatives.push_back(derivatives.adpDerivatives[i]);
+        out.occupancyDerivatives.push_back(derivatives.occupancyDerivatives[i]);
+    }
+    derivatives.atomicPostionDerivatives.swap(out.atomicPostionDerivatives);
+    derivatives.adpDerivatives.swap(out.adpDerivatives);
+    derivatives.occupancyDerivatives.swap(out.occupancyDerivatives);
+}
+
+void DiscambStructureFactorCalculator::set_subset_calculator(
+    SfCalculator *calculator, 
+    const vector<int> &atoms, 
+    const vector<bool> &counted
+){
+    assert(!mUseKernel);
+    assert(atoms.size() == counted.size());
+    mSubsetCalculator = calculator;
+    mSubsetAtoms = atoms;
+    mSubsetContribution = counted;
+    mMainContribution.assign(mCrystal.atoms.size(), true);
+    for (int i = 0; i < atoms.size(); i++){
+        assert(atoms[i] >= 0 && atoms[i] < mCrystal.atoms.size());
+        if (counted[i]) mMainContribution[atoms[i]] = false;
+    }
+    update_calculator();
+}
+
+vector<AtomInCrystal> DiscambStructureFactorCalculator::subset_atoms() const{
+    vector<AtomInCrystal> out;
+    out.reserve(mSubsetAtoms.size());
+    for (int i : mSubsetAtoms)
+        out.push_back(mCrystal.atoms[i]);
     return out;
 }
 
+void DiscambStructureFactorCalculator::set_subset_anomalous(const vector<complex<double>> &anomalous){
+    if (!mSubsetCalculator) return;
+    vector<complex<double>> subsetAnomalous;
+    subsetAnomalous.reserve(mSubsetAtoms.size());
+    for (int i : mSubsetAtoms)
+        subsetAnomalous.push_back(anomalous[i]);
+    mSubsetCalculator->setAnomalous(subsetAnomalous);
+}
+
+void DiscambStructureFactorCalculator::add_subset_f_calc(const vector<Vector3i> &indices, vector<complex<double>> &sf){
+    if (!mSubsetCalculator) return;
+    vector<complex<double>> subsetSf (indices.size());
+    mSubsetCalculator->calculateStructureFactors(subset_atoms(), indices, subsetSf, mSubsetContribution);
+    for (int i = 0; i < sf.size(); i++)
+        sf[i] += subsetSf[i];
+}
+
+void DiscambStructureFactorCalculator::add_subset_derivatives(const Vector3i &hkl, complex<double> &f, SfDerivativesAtHkl &derivatives){
+    // The subsets are disjoint, so derivatives of atoms counted in the subset replace the (zero) main ones
+    if (!mSubsetCalculator) return;
+    complex<double> subsetF;
+    SfDerivativesAtHkl subsetDerivatives;
+    mSubsetCalculator->calculateStructureFactorsAndDerivatives(hkl, subsetF, subsetDerivatives, mSubsetContribution);
+    f += subsetF;
+    for (int i = 0; i < mSubsetAtoms.size(); i++){
+        if (!mSubsetContribution[i]) continue;
+        derivatives.atomicPostionDerivatives[mSubsetAtoms[i]] = subsetDerivatives.atomicPostionDerivatives[i];
+        derivatives.adpDerivatives[mSubsetAtoms[i]] = subsetDerivatives.adpDerivatives[i];
+        derivatives.occupancyDerivatives[mSubsetAtoms[i]] = subsetDerivatives.occupancyDerivatives[i];
+    }
+}
+
+void DiscambStructureFactorCalculator::add_subset_target_derivatives(
+    const vector<Vector3i> &indices,
+    const vector<complex<double>> &d_target_d_f_calc,
+    vector<TargetFunctionAtomicParamDerivatives> &derivatives
+){
+    if (!mSubsetCalculator) return;
+    vector<complex<double>> sf;
+    vector<TargetFunctionAtomicParamDerivatives> subsetDerivatives (mSubsetAtoms.size());
+    mSubsetCalculator->calculateStructureFactorsAndDerivatives(
+        subset_atoms(),
+        indices,
+        sf,
+        subsetDerivatives,
+        d_target_d_f_calc,
+        mSubsetContribution
+    );
+    for (int i = 0; i < mSubsetAtoms.size(); i++)
+        if (mSubsetContribution[i])
+            derivatives[mSubsetAtoms[i]] = subsetDerivatives[i];
+}
+
 void DiscambStructureFactorCalculator::update_calculator(){
     // mCalculator->update(mCrystal.atoms); // Already handled since we pass atoms to calculations
     assert(mAnomalous.size() == mCrystal.atoms.size());
     mCalculator->setAnomalous(mAnomalous);
+    set_subset_anomalous(mAnomalous);
+}
+
+void DiscambStructureFactorCalculator::update_kernel(){
+    // Regroup atoms, since U_iso and anomalous terms may have changed
+    if (!mUseKernel) return;
+    auto start = chrono::steady_clock::now();
+    mKernel.update(mCrystal.atoms, mAnomalous);
+    mStats.n_isotropic_groups = mKernel.n_isotropic_groups();
+    if (mTabulatedKernel)
+        update_tabulated_form_factors();
+    mStats.update_time = seconds_since(start);
 }
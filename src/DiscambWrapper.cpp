@@ -2,17 +2,30 @@
 
 #include "discamb/MathUtilities/Vector3.h"
 
+#include <filesystem>
+#include <fstream>
 #include <utility>
 
 #include "read_structure.hpp"
+#include "miller_indices.hpp"
+#include "crystal_geometry.hpp"
+#include "atom_assignment.hpp"
+#include "scattering_table.hpp"
+
+#include "assert.hpp"
 
 using namespace std;
 using namespace discamb;
 
 namespace py = pybind11;
 
-SfCalculator *get_calculator(py::object structure, FCalcMethod method){
-    Crystal crystal = crystal_from_xray_structure(structure);
+const string &default_databank(){
+    // Resolved once per process, since the lookup searches the data directory
+    static const string bank = py::module::import("pydiscamb.taam_parameters").attr("get_default_databank")().cast<string>();
+    return bank;
+}
+
+nlohmann::json calculator_parameters(py::object structure, FCalcMethod method){
     nlohmann::json calculator_params;
     switch (method)
     {
@@ -25,27 +38,107 @@ SfCalculator *get_calculator(py::object structure, FCalcMethod method){
         break;
     }
     case FCalcMethod::TAAM: {
+        // Multipolar densities are for X-ray and electron scattering
+        const string table = table_from_xray_structure(structure);
+        assert(!is_neutron_table(table));
         calculator_params = {
             {"model", "matts"},
-            {"electron scattering", table_from_xray_structure(structure).find("electron") != string::npos},
-            {"bank path", py::module::import("pydiscamb.taam_parameters").attr("get_default_databank")().cast<string>()},
+            {"electron scattering", table.find("electron") != string::npos},
+            {"bank path", default_databank()},
         };
         break;
     }
     default:
         break;
     }
-    return SfCalculator::create(crystal, calculator_params);
+    return calculator_params;
+}
+
+namespace {
+    bool neutron_parameters(const nlohmann::json &calculator_params){
+        return calculator_params.contains("table") && is_neutron_table(calculator_params["table"].get<string>());
+    }
+
+    // The tabulated kernel converts TAAM form factors to electron scattering itself, 
+    // once per reflection set, so discamb is asked for X-ray form factors.
+    // Neutron scattering lengths are only known to the kernel, and discamb gets a placeholder table
+    nlohmann::json discamb_parameters(nlohmann::json calculator_params, bool native_kernel){
+        if (native_kernel && calculator_params["model"].get<string>() == "matts")
+            calculator_params["electron scattering"] = false;
+        if (neutron_parameters(calculator_params))
+            calculator_params["table"] = table_alias("xray");
+        return calculator_params;
+    }
+
+    bool native_taam(const nlohmann::json &calculator_params, bool native_kernel){
+        return native_kernel && calculator_params["model"].get<string>() == "matts";
+    }
+
+    // Assignment and parameter logs, and the multipole CIF, are written by discamb's own setup
+    bool writes_taam_logs(const nlohmann::json &calculator_params){
+        for (const char *key : {"assignment info", "parameters info", "multipole cif"})
+            if (calculator_params.contains(key) && !calculator_params[key].get<string>().empty())
+                return true;
+        return false;
+    }
+
+    // Charge and scaling are read as discamb reads them for the "matts" model
+    TaamModel taam_model(const Crystal &crystal, const nlohmann::json &calculator_params){
+        double charge = calculator_params.contains("unit cell charge") ? calculator_params["unit cell charge"].get<double>() : 0.0;
+        bool scale = !calculator_params.contains("scale") || calculator_params["scale"].get<bool>();
+        return assign_taam_model(calculator_params["bank path"].get<string>(), crystal, charge, scale);
+    }
+
+    // TAAM calculators are built from one type assignment in the wrapper, with residue templates, 
+    // which also gives the frames of a native kernel. Only calculators writing logs are left to 
+    // SfCalculator::create. A restored model is used as is
+    TaamModel wrapper_taam_model(const Crystal &crystal, const nlohmann::json &calculator_params, TaamModel restored){
+        if (!restored.typeIds.empty() || calculator_params["model"].get<string>() != "matts") return restored;
+        if (writes_taam_logs(calculator_params)) return restored;
+        return taam_model(crystal, calculator_params);
+    }
 }
 
-DiscambWrapper::DiscambWrapper(py::object structure, FCalcMethod method) :
+DiscambWrapper::DiscambWrapper(
+    py::object structure, 
+    const Crystal &crystal, 
+    nlohmann::json calculator_params, 
+    bool native_kernel, 
+    size_t max_table_bytes,
+    TaamModel taam_model
+) :
     mStructure(std::move(structure)),
+    mTaamModel(wrapper_taam_model(crystal, calculator_params, std::move(taam_model))),
     mDiscambCalculator(
-        get_calculator(mStructure, method),
-        crystal_from_xray_structure(mStructure),
+        mTaamModel.typeIds.empty()
+            ? SfCalculator::create(crystal, discamb_parameters(calculator_params, native_kernel))
+            : taam_calculator(crystal, mTaamModel, discamb_parameters(calculator_params, native_kernel)["electron scattering"].get<bool>()),
+        crystal,
         anomalous_from_xray_structure(mStructure)
-    ) 
-    {};
+    ),
+    mAnomalousFlag(mStructure.attr("scatterers")().attr("count_anomalous")().cast<int>() != 0),
+    mReferenceSetting(mStructure.attr("space_group_info")().attr("type")().attr("cb_op")().attr("is_identity_op")().cast<bool>()),
+    mCalculatorParameters(std::move(calculator_params))
+{
+    mDiscambCalculator.set_typing_stats(mTaamModel.nTypedAtoms, mTaamModel.typingTime);
+    if (!native_kernel && !neutron_parameters(mCalculatorParameters)) return;
+    if (native_taam(mCalculatorParameters, native_kernel)){
+        // Logs are only written by discamb's setup, which keeps its assignment
+        assert(!mTaamModel.typeIds.empty());
+        mDiscambCalculator.use_tabulated_kernel(
+            taam_frame_atoms(mTaamModel),
+            max_table_bytes,
+            mCalculatorParameters["electron scattering"].get<bool>()
+        );
+    }
+    else {
+        mDiscambCalculator.use_iam_kernel(mCalculatorParameters["table"].get<string>());
+    }
+}
+
+DiscambWrapper::DiscambWrapper(py::object structure, FCalcMethod method, bool native_kernel, size_t max_table_bytes) :
+    DiscambWrapper(structure, crystal_from_xray_structure(structure), calculator_parameters(structure, method), native_kernel, max_table_bytes)
+{}
 
 DiscambWrapper DiscambWrapper::from_TAAM_parameters(
     py::object structure,
@@ -57,9 +150,6 @@ DiscambWrapper DiscambWrapper::from_TAAM_parameters(
     double unit_cell_charge,
     bool perform_parameter_scaling_from_unit_cell_charge
 ){
-    DiscambWrapper out = DiscambWrapper(structure, FCalcMethod::IAM);
-    Crystal crystal = crystal_from_xray_structure(structure);
-    vector<complex<double>> anomalous = anomalous_from_xray_structure(structure);
     nlohmann::json params {
         {"model", "matts"},
         {"electron scattering", convert_to_electron_scattering},
@@ -70,27 +160,111 @@ DiscambWrapper DiscambWrapper::from_TAAM_parameters(
         {"unit cell charge", unit_cell_charge},
         {"scale", perform_parameter_scaling_from_unit_cell_charge}
     };
-    out.mDiscambCalculator = DiscambStructureFactorCalculator(SfCalculator::create(crystal, params), crystal, anomalous);
+    return DiscambWrapper(structure, crystal_from_xray_structure(structure), params);
+}
+
+DiscambWrapper DiscambWrapper::from_TAAM_setup(
+    py::object structure, 
+    const string &setup_filepath, 
+    bool native_kernel, 
+    size_t max_table_bytes
+){
+    ifstream in { setup_filepath };
+    assert(in.good());
+    nlohmann::json params = nlohmann::json::parse(in);
+    // The reduced bank is stored next to the setup file
+    filesystem::path bank = filesystem::path(setup_filepath).parent_path() / params["bank path"].get<string>();
+    params["bank path"] = bank.string();
+    assert(params.contains("assignment"));
+
+    Crystal crystal = crystal_from_xray_structure(structure);
+    TaamModel model = taam_model_from_json(bank.string(), crystal, params["assignment"]);
+    params.erase("assignment");
+    return DiscambWrapper(structure, crystal, params, native_kernel, max_table_bytes, std::move(model));
+}
+
+void DiscambWrapper::save_TAAM_setup(const string &setup_filepath) const{
+    assert(mCalculatorParameters["model"].get<string>() == "matts");
+    // Calculators set up by discamb, to write its logs, are typed here, since discamb keeps its assignment
+    const TaamModel model = mTaamModel.typeIds.empty() ? taam_model(mDiscambCalculator.crystal(), mCalculatorParameters) : mTaamModel;
+    nlohmann::json setup = mCalculatorParameters;
+    filesystem::path bank = setup_filepath + ".bank.txt";
+    write_bank_entries(setup["bank path"].get<string>(), model.typeLabels, bank.string());
+    setup["bank path"] = bank.filename().string();
+    setup["assignment"] = taam_model_json(model);
+
+    ofstream out { setup_filepath };
+    assert(out.good());
+    out << setup.dump(4);
+}
+
+DiscambWrapper DiscambWrapper::from_hybrid_model(py::object structure, vector<bool> taam_selection, double context_radius){
+    DiscambWrapper out = DiscambWrapper(structure, FCalcMethod::IAM);
+    const Crystal &crystal = out.mDiscambCalculator.crystal();
+    assert(taam_selection.size() == crystal.atoms.size());
+
+    // Type only the selection and its surroundings. The surrounding atoms 
+    // give the selected atoms their environment, but are summed with IAM
+    vector<int> subset = atoms_near_selection(crystal, taam_selection, context_radius);
+    Crystal subsetCrystal = crystal;
+    subsetCrystal.atoms.clear();
+    vector<bool> counted;
+    for (int i : subset){
+        subsetCrystal.atoms.push_back(crystal.atoms[i]);
+        counted.push_back(taam_selection[i]);
+    }
+    // The cut-out has no meaningful net charge, so the bank populations are 
+    // kept instead of being scaled to make it neutral
+    nlohmann::json taamParameters = calculator_parameters(structure, FCalcMethod::TAAM);
+    TaamModel taamModel = assign_taam_model(taamParameters["bank path"].get<string>(), subsetCrystal, 0.0, false);
+    SfCalculator *taam = taam_calculator(subsetCrystal, taamModel, taamParameters["electron scattering"].get<bool>());
+    out.mDiscambCalculator.set_subset_calculator(taam, subset, counted);
     return out;
 }
 
-void DiscambWrapper::set_indices(py::object indices){
-    mDiscambCalculator.hkl.clear();
+void DiscambWrapper::set_indices(py::object indices, const string &set_name){
+    vector<Vector3i> hkl;
     for (auto hkl_py_auto : indices){
         py::tuple hkl_py = hkl_py_auto.cast<py::tuple>();
-        mDiscambCalculator.hkl.push_back(Vector3i {
+        hkl.push_back(Vector3i {
             hkl_py[0].cast<int>(),
             hkl_py[1].cast<int>(),
             hkl_py[2].cast<int>()
         });
     }
+    mDiscambCalculator.set_reflection_set(set_name, hkl);
+}
+
+void DiscambWrapper::set_d_min(const double d_min, const bool sort_by_resolution){
+    vector<Vector3i> hkl;
+    if (!mReferenceSetting || !generate_miller_indices(mDiscambCalculator.crystal(), d_min, mAnomalousFlag, hkl)){
+        // Non-reference settings go through cctbx
+        py::object miller_py = mStructure.attr("build_miller_set")(mAnomalousFlag, d_min);
+        set_indices(miller_py.attr("indices")());
+        hkl = mDiscambCalculator.hkl;
+    }
+    if (sort_by_resolution){
+        sort_indices_by_resolution(mDiscambCalculator.crystal().unitCell, hkl);
+    }
+    mDiscambCalculator.set_reflection_set("", hkl);
+}
+
+vector<tuple<int, int, int>> DiscambWrapper::get_indices(const string &set_name) const{
+    const vector<Vector3i> &indices = mDiscambCalculator.reflection_set(set_name);
+    vector<tuple<int, int, int>> out;
+    out.reserve(indices.size());
+    for (const Vector3i &hkl : indices){
+        out.push_back({hkl[0], hkl[1], hkl[2]});
+    }
+    return out;
 }
 
-void DiscambWrapper::set_d_min(const double d_min){
-    bool anomalous_flag = mStructure.attr("scatterers")().attr("count_anomalous")().cast<int>() != 0;
-    py::object miller_py = mStructure.attr("build_miller_set")(anomalous_flag, d_min);
+void DiscambWrapper::remove_indices(const string &set_name){
+    mDiscambCalculator.remove_reflection_set(set_name);
+}
 
-    set_indices(miller_py.attr("indices")());
+vector<string> DiscambWrapper::reflection_set_names() const{
+    return mDiscambCalculator.reflection_set_names();
 }
 
 vector<complex<double>> DiscambWrapper::f_calc(){
@@ -100,11 +274,69 @@ vector<complex<double>> DiscambWrapper::f_calc(const double d_min){
     set_d_min(d_min);
     return f_calc();
 }
+vector<complex<double>> DiscambWrapper::f_calc(const string &set_name){
+    return mDiscambCalculator.f_calc(set_name);
+}
+
+vector<vector<complex<double>>> DiscambWrapper::f_calc_multi_wavelength(
+    vector<vector<complex<double>>> anomalous_sets,
+    const string &set_name
+){
+    return mDiscambCalculator.f_calc_anomalous_sets(anomalous_sets, set_name);
+}
+
+vector<vector<complex<double>>> DiscambWrapper::f_calc_joint(const vector<string> &tables, const string &set_name){
+    return mDiscambCalculator.f_calc_joint(tables, set_name);
+}
+
+vector<TargetFunctionAtomicParamDerivatives> DiscambWrapper::d_target_d_params_joint(
+    const vector<string> &tables,
+    vector<vector<complex<double>>> d_target_d_f_calc,
+    const vector<double> &weights,
+    const string &set_name
+){
+    return mDiscambCalculator.d_target_d_params_joint(tables, std::move(d_target_d_f_calc), weights, set_name);
+}
+
+vector<double> DiscambWrapper::i_calc_twinned(
+    const vector<vector<vector<int>>> &twin_laws,
+    const vector<double> &fractions,
+    const string &set_name
+){
+    return mDiscambCalculator.i_calc_twinned(twin_laws, fractions, set_name);
+}
+
+pair<vector<TargetFunctionAtomicParamDerivatives>, vector<double>> DiscambWrapper::d_target_d_params_twinned(
+    const vector<vector<vector<int>>> &twin_laws,
+    const vector<double> &fractions,
+    const vector<double> &d_target_d_i_calc,
+    const string &set_name
+){
+    vector<double> d_target_d_fractions;
+    vector<TargetFunctionAtomicParamDerivatives> derivatives = mDiscambCalculator.d_target_d_params_twinned(
+        twin_laws, fractions, d_target_d_i_calc, d_target_d_fractions, set_name
+    );
+    return {derivatives, d_target_d_fractions};
+}
 
 vector<FCalcDerivatives> DiscambWrapper::d_f_calc_d_params(){
     return mDiscambCalculator.d_f_calc_d_params();
 }
 
+vector<FCalcDerivatives> DiscambWrapper::d_f_calc_d_params(vector<vector<int>> indices){
+    vector<Vector3i> hkl;
+    hkl.reserve(indices.size());
+    for (const vector<int> &index : indices){
+        assert(index.size() == 3);
+        hkl.push_back(Vector3i {index[0], index[1], index[2]});
+    }
+    return mDiscambCalculator.d_f_calc_d_params(hkl);
+}
+
+vector<FCalcDerivatives> DiscambWrapper::d_f_calc_d_params(const string &set_name){
+    return mDiscambCalculator.d_f_calc_d_params(set_name);
+}
+
 FCalcDerivatives DiscambWrapper::d_f_calc_hkl_d_params(py::tuple hkl){
     return d_f_calc_hkl_d_params(hkl[0].cast<int>(), hkl[1].cast<int>(), hkl[2].cast<int>());
 }
@@ -113,8 +345,39 @@ FCalcDerivatives DiscambWrapper::d_f_calc_hkl_d_params(int h, int k, int l){
     return mDiscambCalculator.d_f_calc_hkl_d_params(h, k, l);
 }
 
-vector<TargetFunctionAtomicParamDerivatives> DiscambWrapper::d_target_d_params(vector<complex<double>> d_target_d_f_calc){
-    return mDiscambCalculator.d_target_d_params(d_target_d_f_calc);
+vector<TargetFunctionAtomicParamDerivatives> DiscambWrapper::d_target_d_params(
+    vector<complex<double>> d_target_d_f_calc, 
+    const string &set_name
+){
+    return mDiscambCalculator.d_target_d_params(d_target_d_f_calc, set_name);
+}
+
+void DiscambWrapper::update_parameters(){
+    Crystal crystal = mDiscambCalculator.crystal();
+    update_crystal_from_xray_structure(crystal, mStructure);
+    vector<complex<double>> anomalous (crystal.atoms.size());
+    update_anomalous_from_xray_structure(anomalous, mStructure);
+    mDiscambCalculator.update_parameters(crystal.atoms, anomalous);
+    // fp and fdp may have been switched on or off, which changes the indices set_d_min generates
+    mAnomalousFlag = mStructure.attr("scatterers")().attr("count_anomalous")().cast<int>() != 0;
+}
+
+void DiscambWrapper::set_pruning(double tolerance, int n_shells){
+    mDiscambCalculator.set_pruning(tolerance, n_shells);
+}
+
+void DiscambWrapper::set_riding_hydrogens(vector<pair<int, int>> riding_pairs, double u_iso_factor){
+    if (riding_pairs.empty())
+        riding_pairs = find_hydrogen_parents(mDiscambCalculator.crystal(), 1.3);
+    mDiscambCalculator.set_riding_atoms(riding_pairs, u_iso_factor);
+}
+
+vector<int> DiscambWrapper::free_atom_indices() const{
+    return mDiscambCalculator.free_atoms();
+}
+
+const CalculatorStats &DiscambWrapper::stats() const{
+    return mDiscambCalculator.stats();
 }
 
 
@@ -131,3 +394,12 @@ vector<complex<double>> calculate_structure_factors_TAAM(py::object structure, d
 vector<complex<double>> calculate_structure_factors_IAM(py::object structure, double d){
     return calculate_structure_factors(structure, d, FCalcMethod::IAM);
 }
+
+int write_assigned_types_databank(vector<py::object> structures, const string &output_filepath, string bank_filepath){
+    if (bank_filepath.empty())
+        bank_filepath = default_databank();
+    vector<Crystal> crystals;
+    for (py::object structure : structures)
+        crystals.push_back(crystal_from_xray_structure(structure));
+    return write_assigned_types_bank(bank_filepath, crystals, output_filepath);
+}
@@ -0,0 +1,644 @@
+#include "IamKernel.hpp"
+
+#include <cmath>
+#include <map>
+#include <tuple>
+
+#include "assert.hpp"
+
+using namespace std;
+using namespace discamb;
+
+namespace {
+    const double PI = 3.14159265358979323846;
+    const double TWO_PI = 2.0 * PI;
+    const double TWO_PI_SQ = 2.0 * PI * PI;
+}
+
+
+Vector3i IamKernel::Reflections::rotated_index(int entry) const{
+    return Vector3i {
+        static_cast<int>(lround(rotated[3 * entry])),
+        static_cast<int>(lround(rotated[3 * entry + 1])),
+        static_cast<int>(lround(rotated[3 * entry + 2]))
+    };
+}
+
+
+IamKernel::IamKernel(const Crystal &crystal, const string &table, const vector<bool> &tabulated) :
+    mOperations(symmetry_operations(crystal.spaceGroup))
+{
+    reciprocal_metric_tensor(crystal.unitCell, mMetric);
+    assert(tabulated.empty() || tabulated.size() == crystal.atoms.size());
+
+    mTabulatedIndex.assign(crystal.atoms.size(), -1);
+    for (int i = 0; i < tabulated.size(); i++){
+        if (!tabulated[i]) continue;
+        mTabulatedIndex[i] = mTabulatedAtoms.size();
+        mTabulatedAtoms.push_back(i);
+    }
+
+    map<string, int> typeIndices;
+    for (int i = 0; i < crystal.atoms.size(); i++){
+        const AtomInCrystal &atom = crystal.atoms[i];
+        if (mTabulatedIndex[i] >= 0 || typeIndices.count(atom.type)) continue;
+        GaussianScatteringParameters parameters;
+        if (!find_form_factor(atom.type, table, parameters))
+            throw AssertionError(("find_form_factor(\"" + atom.type + "\", \"" + table + "\")").c_str(), __FILE__, __LINE__);
+        typeIndices[atom.type] = mFormFactors.size();
+        mTypeNames.push_back(atom.type);
+        mFormFactors.push_back(parameters);
+    }
+    mFormFactorTypes.assign(crystal.atoms.size(), -1);
+    for (int i = 0; i < crystal.atoms.size(); i++)
+        if (mTabulatedIndex[i] < 0)
+            mFormFactorTypes[i] = typeIndices[crystal.atoms[i].type];
+}
+
+void IamKernel::update(const vector<AtomInCrystal> &atoms, const vector<complex<double>> &anomalous){
+    const int nAtoms = atoms.size();
+    assert(nAtoms == mFormFactorTypes.size());
+    assert(nAtoms == anomalous.size());
+    const double nOperations = mOperations.size();
+
+    mSites.resize(3 * nAtoms);
+    mWeights.resize(nAtoms);
+    mOccupancyWeights.resize(nAtoms);
+    mAdpSizes.resize(nAtoms);
+    mAdps.assign(6 * nAtoms, 0.0);
+    mAnisotropicIndex.assign(nAtoms, -1);
+    mAnomalous = anomalous;
+    mGroups.clear();
+    mAnisotropicAtoms.clear();
+    mAnomalousAnisotropic.clear();
+
+    // Group on exact equality, e.g. after group-B refinement or for fixed-B hydrogens
+    map<tuple<int, double, double, double>, int> groupIndices;
+    for (int i = 0; i < nAtoms; i++){
+        for (int k = 0; k < 3; k++)
+            mSites[3 * i + k] = atoms[i].coordinates[k];
+        mOccupancyWeights[i] = atoms[i].multiplicity / nOperations;
+        mWeights[i] = atoms[i].occupancy * mOccupancyWeights[i];
+        mAdpSizes[i] = atoms[i].adp.size();
+        for (int k = 0; k < atoms[i].adp.size(); k++)
+            mAdps[6 * i + k] = atoms[i].adp[k];
+
+        if (mTabulatedIndex[i] >= 0) continue;
+        if (atoms[i].adp.size() == 6){
+            mAnisotropicIndex[i] = mAnisotropicAtoms.size();
+            if (anomalous[i] != 0.0)
+                mAnomalousAnisotropic.push_back(mAnisotropicAtoms.size());
+            mAnisotropicAtoms.push_back(i);
+            continue;
+        }
+        double uIso = atoms[i].adp.empty() ? 0.0 : atoms[i].adp[0];
+        auto key = make_tuple(mFormFactorTypes[i], uIso, anomalous[i].real(), anomalous[i].imag());
+        auto found = groupIndices.find(key);
+        if (found == groupIndices.end()){
+            groupIndices[key] = mGroups.size();
+            mGroups.push_back(IsotropicGroup {mFormFactorTypes[i], uIso, anomalous[i], {i}});
+        }
+        else {
+            mGroups[found->second].atoms.push_back(i);
+        }
+    }
+
+    const int nAnisotropic = mAnisotropicAtoms.size();
+    mAnisotropicSites.resize(3 * nAnisotropic);
+    mUStar.resize(6 * nAnisotropic);
+    for (int a = 0; a < nAnisotropic; a++){
+        const AtomInCrystal &atom = atoms[mAnisotropicAtoms[a]];
+        for (int k = 0; k < 3; k++)
+            mAnisotropicSites[k * nAnisotropic + a] = atom.coordinates[k];
+        for (int k = 0; k < 6; k++)
+            mUStar[k * nAnisotropic + a] = atom.adp[k];
+    }
+}
+
+IamKernel::Reflections IamKernel::prepare(const vector<Vector3i> &hkl) const{
+    const int nHkl = hkl.size();
+    const int nOperations = mOperations.size();
+    const int nTypes = mFormFactors.size();
+    Reflections out;
+    out.nOperations = nOperations;
+    out.nFormFactorTypes = nTypes;
+    out.dStarSq.resize(nHkl);
+    out.rotated.resize(3 * nHkl * nOperations);
+    out.shifts.resize(nHkl * nOperations);
+    out.monomials.resize(6 * nHkl * nOperations);
+
+    #pragma omp parallel for
+    for (int i = 0; i < nHkl; i++){
+        out.dStarSq[i] = d_star_sq(mMetric, hkl[i]);
+        for (int j = 0; j < nOperations; j++){
+            const int entry = i * nOperations + j;
+            Vector3i rotated = rotate_index(mOperations[j], hkl[i]);
+            double *h = &out.rotated[3 * entry];
+            for (int k = 0; k < 3; k++)
+                h[k] = rotated[k];
+            out.shifts[entry] =
+                hkl[i][0] * mOperations[j].translation[0] +
+                hkl[i][1] * mOperations[j].translation[1] +
+                hkl[i][2] * mOperations[j].translation[2];
+            double *m = &out.monomials[6 * entry];
+            m[0] = h[0] * h[0];
+            m[1] = h[1] * h[1];
+            m[2] = h[2] * h[2];
+            m[3] = 2.0 * h[0] * h[1];
+            m[4] = 2.0 * h[0] * h[2];
+            m[5] = 2.0 * h[1] * h[2];
+        }
+    }
+    evaluate_form_factors(mFormFactors, out.dStarSq, out.formFactors);
+    out.tabulated.resize(mTabulatedAtoms.size() * nHkl * nOperations);
+    return out;
+}
+
+void IamKernel::evaluate_form_factors(
+    const vector<GaussianScatteringParameters> &parameters,
+    const vector<double> &dStarSq,
+    vector<double> &formFactors
+) const{
+    const int nHkl = dStarSq.size();
+    const int nTypes = parameters.size();
+    formFactors.resize(nHkl * nTypes);
+    #pragma omp parallel for
+    for (int i = 0; i < nHkl; i++){
+        // s^2 = (sin(theta) / lambda)^2 = d*^2 / 4
+        const double sSq = dStarSq[i] / 4.0;
+        for (int t = 0; t < nTypes; t++){
+            const GaussianScatteringParameters &p = parameters[t];
+            double ff = p.c;
+            for (int g = 0; g < p.a.size(); g++)
+                ff += p.a[g] * exp(-p.b[g] * sSq);
+            formFactors[i * nTypes + t] = ff;
+        }
+    }
+}
+
+vector<double> IamKernel::form_factors(const Reflections &reflections, const string &table) const{
+    vector<GaussianScatteringParameters> parameters (mTypeNames.size());
+    for (int t = 0; t < mTypeNames.size(); t++)
+        if (!find_form_factor(mTypeNames[t], table, parameters[t]))
+            throw AssertionError(("find_form_factor(\"" + mTypeNames[t] + "\", \"" + table + "\")").c_str(), __FILE__, __LINE__);
+    vector<double> out;
+    evaluate_form_factors(parameters, reflections.dStarSq, out);
+    return out;
+}
+
+void IamKernel::set_tabulated_form_factors(
+    Reflections &reflections, 
+    int entry, 
+    const vector<complex<double>> &formFactors,
+    const vector<bool> &atoms
+) const{
+    const int nEntries = reflections.size() * reflections.nOperations;
+    for (int t = 0; t < mTabulatedAtoms.size(); t++)
+        if (atoms.empty() || atoms[mTabulatedAtoms[t]])
+            reflections.tabulated[t * nEntries + entry] = formFactors[mTabulatedAtoms[t]];
+}
+
+complex<double> IamKernel::isotropic_scattering(const Reflections &reflections, int hklIdx, const IsotropicGroup &group) const{
+    const double ff = reflections.formFactors[hklIdx * reflections.nFormFactorTypes + group.formFactorType];
+    return (ff + group.anomalous) * exp(-TWO_PI_SQ * group.uIso * reflections.dStarSq[hklIdx]);
+}
+
+complex<double> IamKernel::anisotropic_scattering(const Reflections &reflections, int hklIdx, int atom) const{
+    return reflections.formFactors[hklIdx * reflections.nFormFactorTypes + mFormFactorTypes[atom]] + mAnomalous[atom];
+}
+
+void IamKernel::phase_sums(const Reflections &reflections, int hklIdx, int atom, bool derivatives, PhaseSums &sums) const{
+    // For tabulated atoms, the form factor and isotropic Debye-Waller factor enter per operation
+    const int nOperations = reflections.nOperations;
+    const double *site = &mSites[3 * atom];
+    const bool anisotropic = mAdpSizes[atom] == 6;
+    const double *uStar = &mAdps[6 * atom];
+    const complex<double> *tabulated = nullptr;
+    double isotropicFactor = 1.0;
+    if (mTabulatedIndex[atom] >= 0){
+        tabulated = &reflections.tabulated[mTabulatedIndex[atom] * reflections.size() * nOperations + hklIdx * nOperations];
+        if (mAdpSizes[atom] == 1)
+            isotropicFactor = exp(-TWO_PI_SQ * uStar[0] * reflections.dStarSq[hklIdx]);
+    }
+
+    sums.sum = 0.0;
+    for (int k = 0; k < 3; k++)
+        sums.h[k] = 0.0;
+    for (int k = 0; k < 6; k++)
+        sums.monomials[k] = 0.0;
+    for (int j = 0; j < nOperations; j++){
+        const int entry = hklIdx * nOperations + j;
+        const double *h = &reflections.rotated[3 * entry];
+        const double *m = &reflections.monomials[6 * entry];
+        double angle = TWO_PI * (h[0] * site[0] + h[1] * site[1] + h[2] * site[2] + reflections.shifts[entry]);
+        complex<double> term (cos(angle), sin(angle));
+        if (tabulated)
+            term *= isotropicFactor * (tabulated[j] + mAnomalous[atom]);
+        if (anisotropic){
+            double exponent = 0.0;
+            for (int k = 0; k < 6; k++)
+                exponent += m[k] * uStar[k];
+            term *= exp(-TWO_PI_SQ * exponent);
+        }
+        sums.sum += term;
+        if (!derivatives) continue;
+        for (int k = 0; k < 3; k++)
+            sums.h[k] += h[k] * term;
+        if (anisotropic)
+            for (int k = 0; k < 6; k++)
+                sums.monomials[k] += m[k] * term;
+    }
+}
+
+template<typename Scattering>
+void IamKernel::atom_terms(
+    const Reflections &reflections,
+    int hklIdx,
+    int atom,
+    const Scattering &scattering,
+    bool derivatives,
+    AtomTerms &terms
+) const{
+    // scattering is the form factor including anomalous terms, and for
+    // isotropic atoms also the Debye-Waller factor. For tabulated atoms it is 1.
+    // The phase sums are the same either way, and only the products below 
+    // are real times complex for atoms without anomalous terms
+    PhaseSums sums;
+    phase_sums(reflections, hklIdx, atom, derivatives, sums);
+
+    terms.f = mWeights[atom] * scattering * sums.sum;
+    if (!derivatives) return;
+
+    const Scattering weighted = mWeights[atom] * scattering;
+    for (int k = 0; k < 3; k++)
+        terms.xyz[k] = weighted * complex<double>(0.0, TWO_PI) * sums.h[k];
+    if (mAdpSizes[atom] == 6){
+        for (int k = 0; k < 6; k++)
+            terms.adp[k] = -TWO_PI_SQ * weighted * sums.monomials[k];
+    }
+    else {
+        terms.adp[0] = -TWO_PI_SQ * reflections.dStarSq[hklIdx] * terms.f;
+    }
+    terms.occupancy = mOccupancyWeights[atom] * scattering * sums.sum;
+}
+
+void IamKernel::derivative_terms(
+    const Reflections &reflections,
+    int hklIdx,
+    int atom,
+    const complex<double> &scattering,
+    AtomTerms &terms
+) const{
+    if (mAnomalous[atom] == 0.0)
+        atom_terms(reflections, hklIdx, atom, scattering.real(), true, terms);
+    else
+        atom_terms(reflections, hklIdx, atom, scattering, true, terms);
+}
+
+void IamKernel::anisotropic_sums(const Reflections &reflections, int hklIdx, double *real, double *imag) const{
+    const int n = mAnisotropicAtoms.size();
+    const int nOperations = reflections.nOperations;
+    const double *x = mAnisotropicSites.data();
+    const double *y = x + n;
+    const double *z = y + n;
+    const double *u = mUStar.data();
+
+    for (int a = 0; a < n; a++){
+        real[a] = 0.0;
+        imag[a] = 0.0;
+    }
+    for (int j = 0; j < nOperations; j++){
+        const int entry = hklIdx * nOperations + j;
+        const double *h = &reflections.rotated[3 * entry];
+        const double *m = &reflections.monomials[6 * entry];
+        const double shift = reflections.shifts[entry];
+        #pragma omp simd
+        for (int a = 0; a < n; a++){
+            double exponent =
+                m[0] * u[a] + m[1] * u[n + a] + m[2] * u[2 * n + a] +
+                m[3] * u[3 * n + a] + m[4] * u[4 * n + a] + m[5] * u[5 * n + a];
+            double dw = exp(-TWO_PI_SQ * exponent);
+            double angle = TWO_PI * (h[0] * x[a] + h[1] * y[a] + h[2] * z[a] + shift);
+            real[a] += dw * cos(angle);
+            imag[a] += dw * sin(angle);
+        }
+    }
+}
+
+void IamKernel::f_calc(const Reflections &reflections, vector<complex<double>> &f) const{
+    const int nHkl = reflections.size();
+    const int nAnisotropic = mAnisotropicAtoms.size();
+    f.assign(nHkl, 0.0);
+
+    #pragma omp parallel
+    {
+        AtomTerms terms;
+        vector<double> real (nAnisotropic), imag (nAnisotropic);
+        #pragma omp for
+        for (int hklIdx = 0; hklIdx < nHkl; hklIdx++){
+            complex<double> sf = 0.0;
+            for (const IsotropicGroup &group : mGroups){
+                // F = sum over groups of (f + f' + i f'') T * sum over atoms of w S
+                complex<double> groupSum = 0.0;
+                for (int atom : group.atoms){
+                    atom_terms(reflections, hklIdx, atom, 1.0, false, terms);
+                    groupSum += terms.f;
+                }
+                sf += isotropic_scattering(reflections, hklIdx, group) * groupSum;
+            }
+            if (nAnisotropic){
+                anisotropic_sums(reflections, hklIdx, real.data(), imag.data());
+                // Real form factors for all atoms, then the anomalous terms of the few that have them
+                const double *formFactors = &reflections.formFactors[hklIdx * reflections.nFormFactorTypes];
+                double sfReal = 0.0, sfImag = 0.0;
+                for (int a = 0; a < nAnisotropic; a++){
+                    const int atom = mAnisotropicAtoms[a];
+                    const double weighted = mWeights[atom] * formFactors[mFormFactorTypes[atom]];
+                    sfReal += weighted * real[a];
+                    sfImag += weighted * imag[a];
+                }
+                sf += complex<double>(sfReal, sfImag);
+                for (int a : mAnomalousAnisotropic){
+                    const int atom = mAnisotropicAtoms[a];
+                    sf += mWeights[atom] * mAnomalous[atom] * complex<double>(real[a], imag[a]);
+                }
+            }
+            for (int atom : mTabulatedAtoms){
+                atom_terms(reflections, hklIdx, atom, 1.0, false, terms);
+                sf += terms.f;
+            }
+            f[hklIdx] = sf;
+        }
+    }
+}
+
+void IamKernel::f_calc_and_derivatives(
+    const Reflections &reflections,
+    int hklIdx,
+    complex<double> &f,
+    SfDerivativesAtHkl &derivatives
+) const{
+    const int nAtoms = mWeights.size();
+    derivatives.atomicPostionDerivatives.resize(nAtoms);
+    derivatives.adpDerivatives.resize(nAtoms);
+    derivatives.occupancyDerivatives.resize(nAtoms);
+
+    AtomTerms terms;
+    f = 0.0;
+
+    auto store = [&](int atom){
+        f += terms.f;
+        derivatives.atomicPostionDerivatives[atom] = Vector3<complex<double>>(terms.xyz[0], terms.xyz[1], terms.xyz[2]);
+        derivatives.adpDerivatives[atom].assign(terms.adp, terms.adp + mAdpSizes[atom]);
+        derivatives.occupancyDerivatives[atom] = terms.occupancy;
+    };
+    for (const IsotropicGroup &group : mGroups){
+        complex<double> scattering = isotropic_scattering(reflections, hklIdx, group);
+        for (int atom : group.atoms){
+            derivative_terms(reflections, hklIdx, atom, scattering, terms);
+            store(atom);
+        }
+    }
+    for (int atom : mAnisotropicAtoms){
+        derivative_terms(reflections, hklIdx, atom, anisotropic_scattering(reflections, hklIdx, atom), terms);
+        store(atom);
+    }
+    for (int atom : mTabulatedAtoms){
+        atom_terms(reflections, hklIdx, atom, 1.0, true, terms);
+        store(atom);
+    }
+}
+
+void IamKernel::d_target_d_params(
+    const Reflections &reflections,
+    const vector<complex<double>> &d_target_d_f_calc,
+    vector<complex<double>> &f,
+    vector<TargetFunctionAtomicParamDerivatives> &derivatives
+) const{
+    assert(reflections.size() == d_target_d_f_calc.size());
+    const int nHkl = reflections.size();
+    const int nAtoms = mWeights.size();
+    // Per atom: xyz, 6 adp, occupancy
+    const int stride = 10;
+    vector<double> total (stride * nAtoms, 0.0);
+    f.assign(nHkl, 0.0);
+
+    #pragma omp parallel
+    {
+        vector<double> local (stride * nAtoms, 0.0);
+        AtomTerms terms;
+        int k;
+
+        #pragma omp for
+        for (int hklIdx = 0; hklIdx < nHkl; hklIdx++){
+            // dT/dp = Re(conj(dT/dF) dF/dp)
+            const complex<double> d = conj(d_target_d_f_calc[hklIdx]);
+            complex<double> sf = 0.0;
+
+            auto accumulate = [&](int atom){
+                sf += terms.f;
+                double *out = &local[stride * atom];
+                for (k = 0; k < 3; k++)
+                    out[k] += (d * terms.xyz[k]).real();
+                for (k = 0; k < mAdpSizes[atom]; k++)
+                    out[3 + k] += (d * terms.adp[k]).real();
+                out[9] += (d * terms.occupancy).real();
+            };
+            for (const IsotropicGroup &group : mGroups){
+                complex<double> scattering = isotropic_scattering(reflections, hklIdx, group);
+                for (int atom : group.atoms){
+                    derivative_terms(reflections, hklIdx, atom, scattering, terms);
+                    accumulate(atom);
+                }
+            }
+            for (int atom : mAnisotropicAtoms){
+                derivative_terms(reflections, hklIdx, atom, anisotropic_scattering(reflections, hklIdx, atom), terms);
+                accumulate(atom);
+            }
+            for (int atom : mTabulatedAtoms){
+                atom_terms(reflections, hklIdx, atom, 1.0, true, terms);
+                accumulate(atom);
+            }
+            f[hklIdx] = sf;
+        }
+
+        #pragma omp critical
+        for (k = 0; k < total.size(); k++)
+            total[k] += local[k];
+    }
+
+    derivatives.resize(nAtoms);
+    for (int atom = 0; atom < nAtoms; atom++){
+        const double *in = &total[stride * atom];
+        for (int k = 0; k < 3; k++)
+            derivatives[atom].atomic_position_derivatives[k] = in[k];
+        derivatives[atom].adp_derivatives.assign(in + 3, in + 3 + mAdpSizes[atom]);
+        derivatives[atom].occupancy_derivatives = in[9];
+    }
+}
+
+complex<double> IamKernel::radiation_scattering(const Radiation &radiation, int nTypes, int hklIdx, int atom) const{
+    complex<double> out = (*radiation.formFactors)[hklIdx * nTypes + mFormFactorTypes[atom]];
+    if (radiation.anomalous)
+        out += mAnomalous[atom];
+    return out;
+}
+
+void IamKernel::f_calc_joint(
+    const Reflections &reflections,
+    const vector<Radiation> &radiations,
+    vector<vector<complex<double>>> &f
+) const{
+    assert(mTabulatedAtoms.empty());
+    const int nHkl = reflections.size();
+    const int nTypes = reflections.nFormFactorTypes;
+    const int nRadiations = radiations.size();
+    const int nAnisotropic = mAnisotropicAtoms.size();
+    for (const Radiation &radiation : radiations)
+        assert(radiation.formFactors->size() == reflections.formFactors.size());
+    f.assign(nRadiations, vector<complex<double>>(nHkl, 0.0));
+
+    #pragma omp parallel
+    {
+        AtomTerms terms;
+        vector<double> real (nAnisotropic), imag (nAnisotropic);
+        #pragma omp for
+        for (int hklIdx = 0; hklIdx < nHkl; hklIdx++){
+            // The phase and Debye-Waller sums are shared, only the form factors differ
+            for (const IsotropicGroup &group : mGroups){
+                complex<double> groupSum = 0.0;
+                for (int atom : group.atoms){
+                    atom_terms(reflections, hklIdx, atom, 1.0, false, terms);
+                    groupSum += terms.f;
+                }
+                groupSum *= exp(-TWO_PI_SQ * group.uIso * reflections.dStarSq[hklIdx]);
+                for (int r = 0; r < nRadiations; r++)
+                    f[r][hklIdx] += radiation_scattering(radiations[r], nTypes, hklIdx, group.atoms[0]) * groupSum;
+            }
+            if (nAnisotropic){
+                anisotropic_sums(reflections, hklIdx, real.data(), imag.data());
+                for (int a = 0; a < nAnisotropic; a++){
+                    const int atom = mAnisotropicAtoms[a];
+                    const complex<double> sum = mWeights[atom] * complex<double>(real[a], imag[a]);
+                    for (int r = 0; r < nRadiations; r++)
+                        f[r][hklIdx] += radiation_scattering(radiations[r], nTypes, hklIdx, atom) * sum;
+                }
+            }
+        }
+    }
+}
+
+void IamKernel::d_target_d_params_joint(
+    const Reflections &reflections,
+    const vector<Radiation> &radiations,
+    const vector<vector<complex<double>>> &d_target_d_f_calc,
+    vector<vector<complex<double>>> &f,
+    vector<TargetFunctionAtomicParamDerivatives> &derivatives
+) const{
+    assert(mTabulatedAtoms.empty());
+    assert(d_target_d_f_calc.size() == radiations.size());
+    const int nHkl = reflections.size();
+    const int nTypes = reflections.nFormFactorTypes;
+    const int nRadiations = radiations.size();
+    const int nAtoms = mWeights.size();
+    for (int r = 0; r < nRadiations; r++){
+        assert(radiations[r].formFactors->size() == reflections.formFactors.size());
+        assert(d_target_d_f_calc[r].size() == nHkl);
+    }
+    // Per atom: xyz, 6 adp, occupancy
+    const int stride = 10;
+    vector<double> total (stride * nAtoms, 0.0);
+    f.assign(nRadiations, vector<complex<double>>(nHkl, 0.0));
+
+    #pragma omp parallel
+    {
+        vector<double> local (stride * nAtoms, 0.0);
+        vector<complex<double>> d (nRadiations);
+        AtomTerms terms;
+        int k;
+
+        #pragma omp for
+        for (int hklIdx = 0; hklIdx < nHkl; hklIdx++){
+            for (int r = 0; r < nRadiations; r++)
+                d[r] = conj(d_target_d_f_calc[r][hklIdx]);
+
+            // The terms are linear in the form factor, so with the geometric terms X of an atom,
+            // sum_r Re(conj(dT_r/dF_r) f_r X) = Re((sum_r conj(dT_r/dF_r) f_r) X)
+            auto accumulate = [&](int atom){
+                complex<double> weighted = 0.0;
+                for (int r = 0; r < nRadiations; r++){
+                    const complex<double> scattering = radiation_scattering(radiations[r], nTypes, hklIdx, atom);
+                    f[r][hklIdx] += scattering * terms.f;
+                    weighted += d[r] * scattering;
+                }
+                double *out = &local[stride * atom];
+                for (k = 0; k < 3; k++)
+                    out[k] += (weighted * terms.xyz[k]).real();
+                for (k = 0; k < mAdpSizes[atom]; k++)
+                    out[3 + k] += (weighted * terms.adp[k]).real();
+                out[9] += (weighted * terms.occupancy).real();
+            };
+            for (const IsotropicGroup &group : mGroups){
+                const double dw = exp(-TWO_PI_SQ * group.uIso * reflections.dStarSq[hklIdx]);
+                for (int atom : group.atoms){
+                    atom_terms(reflections, hklIdx, atom, dw, true, terms);
+                    accumulate(atom);
+                }
+            }
+            for (int atom : mAnisotropicAtoms){
+                atom_terms(reflections, hklIdx, atom, 1.0, true, terms);
+                accumulate(atom);
+            }
+        }
+
+        #pragma omp critical
+        for (k = 0; k < total.size(); k++)
+            total[k] += local[k];
+    }
+
+    derivatives.resize(nAtoms);
+    for (int atom = 0; atom < nAtoms; atom++){
+        const double *in = &total[stride * atom];
+        for (int k = 0; k < 3; k++)
+            derivatives[atom].atomic_position_derivatives[k] = in[k];
+        derivatives[atom].adp_derivatives.assign(in + 3, in + 3 + mAdpSizes[atom]);
+        derivatives[atom].occupancy_derivatives = in[9];
+    }
+}
+
+vector<vector<complex<double>>> IamKernel::unit_contributions(const vector<Vector3i> &hkl, const vector<int> &atoms) const{
+    const int nHkl = hkl.size();
+    const int nOperations = mOperations.size();
+    vector<vector<complex<double>>> out (atoms.size(), vector<complex<double>>(nHkl));
+
+    #pragma omp parallel for
+    for (int hklIdx = 0; hklIdx < nHkl; hklIdx++){
+        const double dStarSq = d_star_sq(mMetric, hkl[hklIdx]);
+        for (int i = 0; i < atoms.size(); i++){
+            const int atom = atoms[i];
+            const double *site = &mSites[3 * atom];
+            const double *u = &mAdps[6 * atom];
+            complex<double> sum = 0.0;
+            for (int j = 0; j < nOperations; j++){
+                const Vector3i h = rotate_index(mOperations[j], hkl[hklIdx]);
+                const double shift =
+                    hkl[hklIdx][0] * mOperations[j].translation[0] +
+                    hkl[hklIdx][1] * mOperations[j].translation[1] +
+                    hkl[hklIdx][2] * mOperations[j].translation[2];
+                const double angle = TWO_PI * (h[0] * site[0] + h[1] * site[1] + h[2] * site[2] + shift);
+                complex<double> term (cos(angle), sin(angle));
+                if (mAdpSizes[atom] == 6){
+                    const double exponent =
+                        h[0] * h[0] * u[0] + h[1] * h[1] * u[1] + h[2] * h[2] * u[2] +
+                        2.0 * (h[0] * h[1] * u[3] + h[0] * h[2] * u[4] + h[1] * h[2] * u[5]);
+                    term *= exp(-TWO_PI_SQ * exponent);
+                }
+                sum += term;
+            }
+            if (mAdpSizes[atom] == 1)
+                sum *= exp(-TWO_PI_SQ * u[0] * dStarSq);
+            out[i][hklIdx] = mWeights[atom] * sum;
+        }
+    }
+    return out;
+}
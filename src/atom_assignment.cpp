@@ -18,8 +18,12 @@
 #include "discamb/MathUtilities/statistics.h"
 #include "discamb/StructuralProperties/structural_properties.h"
 #include "discamb/AtomTyping/atom_typing_utilities.h"
+#include "discamb/CrystalStructure/crystal_structure_utilities.h"
+#include "discamb/Scattering/AnyHcCalculator.h"
+#include "discamb/Scattering/taam_utilities.h"
 
 
+#include <algorithm>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
@@ -28,8 +32,12 @@
 #include <deque>
 #include <chrono>
 #include <ctime>
+#include <memory>
 
 #include "atom_assignment.hpp"
+#include "crystal_geometry.hpp"
+
+#include "assert.hpp"
 
 using namespace discamb;
 using namespace std;
@@ -832,6 +840,533 @@ bool read_bank_and_assign_atoms(
     return true;
 }
 
+namespace {
+    const set<string> STANDARD_RESIDUES {
+        "ALA", "ARG", "ASN", "ASP", "CYS", "GLN", "GLU", "GLY", "HIS", "ILE", 
+        "LEU", "LYS", "MET", "PHE", "PRO", "SER", "THR", "TRP", "TYR", "VAL"
+    };
+    // Atoms surrounding those typed outside templates, giving them their environment
+    const double CONTEXT_RADIUS = 4.0;
+
+    struct Residue {
+        string name;
+        string chain;
+        vector<int> atoms;
+        bool alternative = false; // Has alternative conformations
+    };
+
+    string trimmed(const string &s){
+        size_t first = s.find_first_not_of(" \t\r");
+        if (first == string::npos) return "";
+        return s.substr(first, s.find_last_not_of(" \t\r") - first + 1);
+    }
+
+    // Residues from labels of the form pdb=" CA  TYR A   4 ", in order of appearance.
+    // residueOf is -1 for atoms with other labels
+    vector<Residue> read_residues(const Crystal &crystal, vector<int> &residueOf, vector<string> &atomNames){
+        vector<Residue> out;
+        map<string, int> residueIndices;
+        residueOf.assign(crystal.atoms.size(), -1);
+        atomNames.assign(crystal.atoms.size(), "");
+        for (int i = 0; i < crystal.atoms.size(); i++){
+            const string &label = crystal.atoms[i].label;
+            if (label.size() < 21 || label.compare(0, 5, "pdb=\"") != 0) continue;
+            const string content = label.substr(5, 15);
+            // Chain, sequence number and insertion code
+            const string residueId = content.substr(9, 6);
+            auto found = residueIndices.find(residueId);
+            if (found == residueIndices.end()){
+                found = residueIndices.emplace(residueId, out.size()).first;
+                out.push_back(Residue {trimmed(content.substr(5, 3)), content.substr(9, 1)});
+            }
+            Residue &residue = out[found->second];
+            residue.atoms.push_back(i);
+            residue.alternative = residue.alternative || content[4] != ' ';
+            residueOf[i] = found->second;
+            atomNames[i] = trimmed(content.substr(0, 4));
+        }
+        return out;
+    }
+
+    void read_bank(
+        const string &bank_filepath, 
+        vector<AtomType> &atomTypes, 
+        vector<AtomTypeHC_Parameters> &hcParameters, 
+        CrystalAtomTypeAssigner &crystalAssigner
+    ){
+        BankSettings bankSettings;
+        MATTS_BankReader bankReader;
+        ifstream bankStream { bank_filepath };
+        assert(bankStream.good());
+        bankReader.read(bankStream, atomTypes, hcParameters, bankSettings, true);
+        crystalAssigner.setDescriptorsSettings(bankSettings.descriptorsSettings);
+        crystalAssigner.setAtomTypes(atomTypes);
+    }
+
+    Crystal subcrystal(const Crystal &crystal, const vector<int> &atoms){
+        Crystal out = crystal;
+        out.atoms.clear();
+        for (int i : atoms)
+            out.atoms.push_back(crystal.atoms[i]);
+        return out;
+    }
+
+    // Copy of a local coordinate system with its atoms renumbered, keeping their symmetry operations
+    template<typename Renumber>
+    LocalCoordinateSystem<AtomInCrystalID> renumbered(LocalCoordinateSystem<AtomInCrystalID> lcs, Renumber renumber){
+        auto apply = [&](AtomInCrystalID &point){
+            point = AtomInCrystalID(renumber(point.index()), point.getSymmetryOperation());
+        };
+        apply(lcs.centralAtom);
+        for (vector<AtomInCrystalID> *points : {&lcs.refPoint_1, &lcs.refPoint_2, &lcs.chirality})
+            for (AtomInCrystalID &point : *points)
+                apply(point);
+        return lcs;
+    }
+
+    // Types and coordinate systems of every atom. Atoms without a type get a coordinate system of only themselves
+    void assign_crystal(const Crystal &crystal, CrystalAtomTypeAssigner &crystalAssigner, vector<int> &typeIds, vector<LocalCoordinateSystem<AtomInCrystalID>> &lcs){
+        StructureWithDescriptors structure;
+        crystalAssigner.assign(crystal, typeIds, lcs, structure);
+        const int nAtoms = crystal.atoms.size();
+        typeIds.resize(nAtoms, -1);
+        lcs.resize(nAtoms);
+        for (int atomIdx = 0; atomIdx < nAtoms; atomIdx++){
+            if (typeIds[atomIdx] >= 0) continue;
+            lcs[atomIdx] = LocalCoordinateSystem<AtomInCrystalID>();
+            lcs[atomIdx].centralAtom = AtomInCrystalID(atomIdx, SpaceGroupOperation());
+        }
+    }
+
+    // Type of a residue template atom, with the atoms of its coordinate system numbered by their 
+    // position in the template context
+    struct TemplateAtom {
+        int typeId;
+        LocalCoordinateSystem<AtomInCrystalID> lcs;
+    };
+    struct ResidueTemplate {
+        vector<pair<int, string>> context; // Residue offset and atom name
+        map<string, TemplateAtom> atoms;
+        bool confirmed = false; // A second instance was typed alike
+        bool rejected = false;
+    };
+
+    // Assign standard residues with both neighbouring residues present from templates, typed from 
+    // the first two instances per residue name, atom names and neighbour class (proline, glycine or 
+    // other), and reused for the other instances. Termini, ligands, modified residues, alternative conformations and residues 
+    // bonded beyond their neighbours, e.g. by disulfide bridges, are left unassigned
+    void assign_from_residue_templates(
+        const Crystal &crystal, 
+        CrystalAtomTypeAssigner &crystalAssigner, 
+        TaamModel &model, 
+        vector<bool> &assigned
+    ){
+        vector<int> residueOf;
+        vector<string> atomNames;
+        vector<Residue> residues = read_residues(crystal, residueOf, atomNames);
+        if (residues.empty()) return;
+
+        // Generous bonding radii, so that any covalent contact is found. Non-bonded 
+        // contacts found with them only send residues to full assignment
+        vector<double> radii (crystal.atoms.size(), 1.25);
+        for (int i = 0; i < crystal.atoms.size(); i++)
+            if (crystal.atoms[i].type == "H" || crystal.atoms[i].type == "D")
+                radii[i] = 0.2;
+        vector<vector<int>> neighbours = neighbour_lists(crystal, radii);
+
+        map<pair<int, string>, int> atomIndices;
+        for (int i = 0; i < crystal.atoms.size(); i++)
+            if (residueOf[i] >= 0)
+                atomIndices[{residueOf[i], atomNames[i]}] = i;
+
+        auto neighbour_class = [&](int r) -> string {
+            const Residue &residue = residues[r];
+            if (!STANDARD_RESIDUES.count(residue.name) || residue.alternative) return "";
+            return residue.name == "PRO" || residue.name == "GLY" ? residue.name : "X";
+        };
+
+        map<string, ResidueTemplate> templates;
+        for (int r = 1; r + 1 < residues.size(); r++){
+            const Residue &residue = residues[r];
+            if (neighbour_class(r).empty()) continue;
+            if (residues[r - 1].chain != residue.chain || residues[r + 1].chain != residue.chain) continue;
+            const string previousClass = neighbour_class(r - 1), nextClass = neighbour_class(r + 1);
+            if (previousClass.empty() || nextClass.empty()) continue;
+
+            // Bonded to both neighbours, and to nothing else
+            bool linkedToPrevious = false, linkedToNext = false, isolated = true;
+            for (int atom : residue.atoms)
+                for (int n : neighbours[atom]){
+                    linkedToPrevious = linkedToPrevious || residueOf[n] == r - 1;
+                    linkedToNext = linkedToNext || residueOf[n] == r + 1;
+                    isolated = isolated && residueOf[n] >= r - 1 && residueOf[n] <= r + 1;
+                }
+            if (!linkedToPrevious || !linkedToNext || !isolated) continue;
+
+            vector<string> names;
+            for (int atom : residue.atoms)
+                names.push_back(atomNames[atom]);
+            sort(names.begin(), names.end());
+            if (adjacent_find(names.begin(), names.end()) != names.end()) continue;
+            string key = previousClass + " " + residue.name + " " + nextClass;
+            for (const string &name : names)
+                key += " " + name;
+
+            // Type an instance in the context of its neighbouring residues
+            auto type_instance = [&](){
+                vector<int> context;
+                for (int c = r - 1; c <= r + 1; c++)
+                    context.insert(context.end(), residues[c].atoms.begin(), residues[c].atoms.end());
+                sort(context.begin(), context.end());
+                vector<int> contextTypes;
+                vector<LocalCoordinateSystem<AtomInCrystalID>> contextLcs;
+                assign_crystal(subcrystal(crystal, context), crystalAssigner, contextTypes, contextLcs);
+                model.nTypedAtoms += context.size();
+
+                ResidueTemplate out;
+                for (int i = 0; i < context.size(); i++){
+                    out.context.push_back({residueOf[context[i]] - r, atomNames[context[i]]});
+                    if (residueOf[context[i]] == r)
+                        out.atoms[atomNames[context[i]]] = TemplateAtom {contextTypes[i], contextLcs[i]};
+                }
+                return out;
+            };
+
+            // The first instance becomes the template. A second instance is typed as well, and
+            // the template is only reused if their types agree, so that one distorted residue 
+            // does not pass its types on. Residues of a rejected template are typed in full
+            auto found = templates.find(key);
+            ResidueTemplate instanceTemplate;
+            if (found == templates.end()){
+                instanceTemplate = type_instance();
+                found = templates.emplace(key, instanceTemplate).first;
+            }
+            else if (found->second.rejected){
+                continue;
+            }
+            else if (!found->second.confirmed){
+                instanceTemplate = type_instance();
+                for (const auto &atom : instanceTemplate.atoms)
+                    found->second.rejected = found->second.rejected || found->second.atoms.at(atom.first).typeId != atom.second.typeId;
+                found->second.confirmed = !found->second.rejected;
+                if (found->second.rejected) continue;
+            }
+            else {
+                instanceTemplate = found->second;
+            }
+
+            // Neighbouring residues may lack an atom of the template, e.g. with other hydrogen names
+            bool complete = true;
+            auto instance_atom = [&](int contextIdx){
+                auto mapped = atomIndices.find({r + instanceTemplate.context[contextIdx].first, instanceTemplate.context[contextIdx].second});
+                complete = complete && mapped != atomIndices.end();
+                return complete ? mapped->second : 0;
+            };
+            vector<LocalCoordinateSystem<AtomInCrystalID>> instanceLcs;
+            for (int atom : residue.atoms)
+                instanceLcs.push_back(renumbered(instanceTemplate.atoms.at(atomNames[atom]).lcs, instance_atom));
+            if (!complete) continue;
+            for (int i = 0; i < residue.atoms.size(); i++){
+                const int atom = residue.atoms[i];
+                model.typeIds[atom] = instanceTemplate.atoms.at(atomNames[atom]).typeId;
+                model.lcs[atom] = instanceLcs[i];
+                assigned[atom] = true;
+            }
+        }
+    }
+
+    // Types and coordinate systems of every atom, typing standard residues from templates 
+    // and the remaining atoms in their surroundings
+    void assign_types(const Crystal &crystal, CrystalAtomTypeAssigner &crystalAssigner, bool residue_templates, TaamModel &model){
+        const int nAtoms = crystal.atoms.size();
+        model.typeIds.assign(nAtoms, -1);
+        model.lcs.assign(nAtoms, LocalCoordinateSystem<AtomInCrystalID>());
+        model.nTypedAtoms = 0;
+        vector<bool> assigned (nAtoms, false);
+        if (residue_templates)
+            assign_from_residue_templates(crystal, crystalAssigner, model, assigned);
+
+        vector<bool> remaining (nAtoms);
+        int nRemaining = 0;
+        for (int i = 0; i < nAtoms; i++){
+            remaining[i] = !assigned[i];
+            nRemaining += remaining[i];
+        }
+        if (nRemaining == 0) return;
+        if (nRemaining == nAtoms){
+            assign_crystal(crystal, crystalAssigner, model.typeIds, model.lcs);
+            model.nTypedAtoms += nAtoms;
+            return;
+        }
+
+        // Type the remaining atoms in their surroundings
+        vector<int> subset = atoms_near_selection(crystal, remaining, CONTEXT_RADIUS);
+        vector<int> subsetTypes;
+        vector<LocalCoordinateSystem<AtomInCrystalID>> subsetLcs;
+        assign_crystal(subcrystal(crystal, subset), crystalAssigner, subsetTypes, subsetLcs);
+        model.nTypedAtoms += subset.size();
+        for (int i = 0; i < subset.size(); i++){
+            if (!remaining[subset[i]]) continue;
+            model.typeIds[subset[i]] = subsetTypes[i];
+            model.lcs[subset[i]] = renumbered(subsetLcs[i], [&](int subsetIdx){ return subset[subsetIdx]; });
+        }
+    }
+
+    // Multipole parameters of the typed atoms, with valence populations scaled to unit_cell_charge
+    void transfer_parameters(
+        const vector<AtomTypeHC_Parameters> &hcParameters, 
+        const Crystal &crystal, 
+        double unit_cell_charge, 
+        TaamModel &model
+    ){
+        vector<int> atomicNumbers;
+        crystal_structure_utilities::atomicNumbers(crystal, atomicNumbers);
+        vector<double> multiplicityTimesOccupancy;
+        for (const AtomInCrystal &atom : crystal.atoms)
+            multiplicityTimesOccupancy.push_back(atom.multiplicity * atom.occupancy);
+        vector<int> nonMultipolarAtoms;
+        taam_utilities::type_assignment_to_HC_parameters(
+            hcParameters, model.typeIds, multiplicityTimesOccupancy, atomicNumbers, 
+            unit_cell_charge, model.parameters, true, nonMultipolarAtoms
+        );
+    }
+
+    // Atom index and symmetry operation
+    nlohmann::json point_json(const AtomInCrystalID &point){
+        string operation;
+        point.getSymmetryOperation().get(operation);
+        return {point.index(), operation};
+    }
+
+    AtomInCrystalID json_point(const nlohmann::json &point){
+        return AtomInCrystalID(point[0].get<int>(), SpaceGroupOperation(point[1].get<string>()));
+    }
+
+    nlohmann::json points_json(const vector<AtomInCrystalID> &points){
+        nlohmann::json out = nlohmann::json::array();
+        for (const AtomInCrystalID &point : points)
+            out.push_back(point_json(point));
+        return out;
+    }
+
+    vector<AtomInCrystalID> json_points(const nlohmann::json &points){
+        vector<AtomInCrystalID> out;
+        for (const nlohmann::json &point : points)
+            out.push_back(json_point(point));
+        return out;
+    }
+
+    nlohmann::json lcs_json(const LocalCoordinateSystem<AtomInCrystalID> &lcs){
+        nlohmann::json out;
+        out["central atom"] = point_json(lcs.centralAtom);
+        out["reference points 1"] = points_json(lcs.refPoint_1);
+        out["reference points 2"] = points_json(lcs.refPoint_2);
+        out["chirality"] = points_json(lcs.chirality);
+        out["direction types"] = {static_cast<int>(lcs.direction1_type), static_cast<int>(lcs.direction2_type)};
+        out["coordinates"] = {static_cast<int>(lcs.coordinate_1), static_cast<int>(lcs.coordinate_2)};
+        out["right handed"] = lcs.isR;
+        return out;
+    }
+
+    LocalCoordinateSystem<AtomInCrystalID> json_lcs(const nlohmann::json &saved){
+        LocalCoordinateSystem<AtomInCrystalID> lcs;
+        lcs.centralAtom = json_point(saved["central atom"]);
+        lcs.refPoint_1 = json_points(saved["reference points 1"]);
+        lcs.refPoint_2 = json_points(saved["reference points 2"]);
+        lcs.chirality = json_points(saved["chirality"]);
+        lcs.direction1_type = static_cast<decltype(lcs.direction1_type)>(saved["direction types"][0].get<int>());
+        lcs.direction2_type = static_cast<decltype(lcs.direction2_type)>(saved["direction types"][1].get<int>());
+        lcs.coordinate_1 = static_cast<decltype(lcs.coordinate_1)>(saved["coordinates"][0].get<int>());
+        lcs.coordinate_2 = static_cast<decltype(lcs.coordinate_2)>(saved["coordinates"][1].get<int>());
+        lcs.isR = saved["right handed"].get<bool>();
+        return lcs;
+    }
+}
+
+vector<vector<int>> taam_frame_atoms(const TaamModel &model){
+    // Symmetry images are reduced to their asymmetric unit atom, 
+    // since these move together
+    const int nAtoms = model.typeIds.size();
+    vector<vector<int>> out (nAtoms);
+    for (int atomIdx = 0; atomIdx < nAtoms; atomIdx++){
+        vector<int> &frame = out[atomIdx];
+        frame.push_back(atomIdx);
+        if (model.typeIds[atomIdx] < 0) continue;
+
+        const LocalCoordinateSystem<AtomInCrystalID> &coordinateSystem = model.lcs[atomIdx];
+        frame.push_back(coordinateSystem.centralAtom.index());
+        for (const vector<AtomInCrystalID> *points : {&coordinateSystem.refPoint_1, &coordinateSystem.refPoint_2, &coordinateSystem.chirality})
+            for (const AtomInCrystalID &point : *points)
+                frame.push_back(point.index());
+        sort(frame.begin(), frame.end());
+        frame.erase(unique(frame.begin(), frame.end()), frame.end());
+    }
+    return out;
+}
+
+vector<vector<int>> local_coordinate_system_atoms(const string bank_filepath, const Crystal &crystal, bool residue_templates){
+    vector<AtomType> atomTypes;
+    vector<AtomTypeHC_Parameters> hcParameters;
+    CrystalAtomTypeAssigner crystalAssigner;
+    read_bank(bank_filepath, atomTypes, hcParameters, crystalAssigner);
+
+    TaamModel model;
+    assign_types(crystal, crystalAssigner, residue_templates, model);
+    return taam_frame_atoms(model);
+}
+
+TaamModel assign_taam_model(
+    const string bank_filepath, 
+    const Crystal &crystal, 
+    double unit_cell_charge, 
+    bool scale, 
+    bool residue_templates
+){
+    auto start = chrono::steady_clock::now();
+    vector<AtomType> atomTypes;
+    vector<AtomTypeHC_Parameters> hcParameters;
+    CrystalAtomTypeAssigner crystalAssigner;
+    read_bank(bank_filepath, atomTypes, hcParameters, crystalAssigner);
+
+    TaamModel model;
+    assign_types(crystal, crystalAssigner, residue_templates, model);
+    for (int typeId : model.typeIds)
+        model.typeLabels.push_back(typeId < 0 ? "" : atomTypes[typeId].id);
+
+    transfer_parameters(hcParameters, crystal, unit_cell_charge, model);
+    // Without scaling, the populations are those of the bank
+    if (!scale)
+        for (int atomIdx = 0; atomIdx < model.typeIds.size(); atomIdx++)
+            if (model.typeIds[atomIdx] >= 0)
+                model.parameters.type_parameters[model.parameters.atom_to_type_map[atomIdx]].p_val = hcParameters[model.typeIds[atomIdx]].p_val;
+
+    model.typingTime = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return model;
+}
+
+nlohmann::json taam_model_json(const TaamModel &model){
+    nlohmann::json lcs = nlohmann::json::array();
+    for (const LocalCoordinateSystem<AtomInCrystalID> &coordinateSystem : model.lcs)
+        lcs.push_back(lcs_json(coordinateSystem));
+    nlohmann::json typeParameters = nlohmann::json::array();
+    for (const HC_AtomTypeParameters &type : model.parameters.type_parameters){
+        nlohmann::json parameters;
+        parameters["p_val"] = type.p_val;
+        parameters["kappa"] = type.kappa_spherical_valence;
+        parameters["kappa'"] = type.kappa_deformation_valence;
+        parameters["p_lm"] = type.p_lm;
+        typeParameters.push_back(parameters);
+    }
+
+    nlohmann::json out;
+    out["types"] = model.typeLabels;
+    out["local coordinate systems"] = lcs;
+    out["atom to type parameters"] = model.parameters.atom_to_type_map;
+    out["type parameters"] = typeParameters;
+    return out;
+}
+
+TaamModel taam_model_from_json(const string bank_filepath, const Crystal &crystal, const nlohmann::json &saved){
+    vector<AtomType> atomTypes;
+    vector<AtomTypeHC_Parameters> hcParameters;
+    CrystalAtomTypeAssigner crystalAssigner;
+    read_bank(bank_filepath, atomTypes, hcParameters, crystalAssigner);
+    map<string, int> typeIndices;
+    for (int i = 0; i < atomTypes.size(); i++)
+        typeIndices[atomTypes[i].id] = i;
+
+    TaamModel model;
+    model.typeLabels = saved["types"].get<vector<string>>();
+    assert(model.typeLabels.size() == crystal.atoms.size());
+    for (const string &label : model.typeLabels){
+        auto found = typeIndices.find(label);
+        assert(label.empty() || found != typeIndices.end());
+        model.typeIds.push_back(label.empty() ? -1 : found->second);
+    }
+    for (const nlohmann::json &coordinateSystem : saved["local coordinate systems"])
+        model.lcs.push_back(json_lcs(coordinateSystem));
+    assert(model.lcs.size() == crystal.atoms.size());
+
+    // The bank gives the wavefunctions of the atoms, and the saved parameters the scaled multipoles
+    transfer_parameters(hcParameters, crystal, 0.0, model);
+    model.parameters.atom_to_type_map = saved["atom to type parameters"].get<vector<int>>();
+    model.parameters.type_parameters.clear();
+    for (const nlohmann::json &parameters : saved["type parameters"]){
+        HC_AtomTypeParameters type;
+        type.p_val = parameters["p_val"].get<double>();
+        type.kappa_spherical_valence = parameters["kappa"].get<double>();
+        type.kappa_deformation_valence = parameters["kappa'"].get<double>();
+        type.p_lm = parameters["p_lm"].get<vector<vector<double>>>();
+        model.parameters.type_parameters.push_back(type);
+    }
+    assert(model.parameters.atom_to_type_map.size() == crystal.atoms.size());
+    return model;
+}
+
+SfCalculator *taam_calculator(const Crystal &crystal, const TaamModel &model, bool electron_scattering){
+    vector<shared_ptr<LocalCoordinateSystemInCrystal>> lcs;
+    for (const LocalCoordinateSystem<AtomInCrystalID> &coordinateSystem : model.lcs)
+        lcs.push_back(make_shared<LocalCoordinateSystemCalculator>(coordinateSystem, crystal));
+    return new AnyHcCalculator(crystal, model.parameters, lcs, electron_scattering);
+}
+
+int write_assigned_types_bank(const string bank_filepath, const vector<Crystal> &crystals, const string output_filepath){
+    vector<AtomType> atomTypes;
+    vector<AtomTypeHC_Parameters> hcParameters;
+    CrystalAtomTypeAssigner crystalAssigner;
+    read_bank(bank_filepath, atomTypes, hcParameters, crystalAssigner);
+
+    vector<string> usedTypes;
+    for (const Crystal &crystal : crystals){
+        vector<int> typeIds;
+        vector < LocalCoordinateSystem<AtomInCrystalID> > lcs;
+        StructureWithDescriptors structure;
+        crystalAssigner.assign(crystal, typeIds, lcs, structure);
+        for (int typeId : typeIds)
+            if (typeId >= 0)
+                usedTypes.push_back(atomTypes[typeId].id);
+    }
+    return write_bank_entries(bank_filepath, usedTypes, output_filepath);
+}
+
+int write_bank_entries(const string bank_filepath, const vector<string> &type_ids, const string output_filepath){
+    set<string> usedTypes (type_ids.begin(), type_ids.end());
+    usedTypes.erase(""); // Atoms without a type
+
+    // Copy the bank text, keeping everything before the first entry, e.g. the 
+    // settings, and the entries of used types. An entry starts with a line 
+    // ENTRY, and its type is on the first non-empty line after a line ID
+    ifstream in { bank_filepath };
+    assert(in.good());
+    vector<string> lines;
+    for (string line; getline(in, line);)
+        lines.push_back(line);
+    ofstream out { output_filepath };
+    assert(out.good());
+
+    int nKept = 0;
+    size_t entryStart = 0;
+    while (entryStart < lines.size() && trimmed(lines[entryStart]) != "ENTRY")
+        out << lines[entryStart++] << "\n";
+    while (entryStart < lines.size()){
+        size_t entryEnd = entryStart + 1;
+        while (entryEnd < lines.size() && trimmed(lines[entryEnd]) != "ENTRY")
+            entryEnd++;
+        string id;
+        for (size_t i = entryStart + 1; i < entryEnd && id.empty(); i++){
+            if (trimmed(lines[i]) != "ID") continue;
+            for (size_t j = i + 1; j < entryEnd && id.empty(); j++)
+                id = trimmed(lines[j]);
+        }
+        if (usedTypes.count(id)){
+            for (size_t i = entryStart; i < entryEnd; i++)
+                out << lines[i] << "\n";
+            nKept++;
+        }
+        entryStart = entryEnd;
+    }
+    return nKept;
+}
 
 void findMultitypes(
     const vector<AtomType> &types,
@@ -0,0 +1,170 @@
+#include "crystal_geometry.hpp"
+
+#include "discamb/MathUtilities/Matrix3.h"
+
+#include <cmath>
+
+#include "assert.hpp"
+
+using namespace std;
+using namespace discamb;
+
+
+vector<SymmetryOperation> symmetry_operations(const SpaceGroup &spaceGroup){
+    vector<SymmetryOperation> out (spaceGroup.nSymmetryOperations());
+    Matrix3d rotation;
+    Vector3d translation;
+    for (int op = 0; op < out.size(); op++){
+        spaceGroup.getSpaceGroupOperation(op).get(rotation, translation);
+        for (int i = 0; i < 3; i++){
+            for (int j = 0; j < 3; j++)
+                out[op].rotation[i][j] = static_cast<int>(round(rotation(i, j)));
+            out[op].translation[i] = translation[i];
+        }
+    }
+    return out;
+}
+
+Vector3i rotate_index(const SymmetryOperation &operation, const Vector3i &hkl){
+    Vector3i out;
+    for (int j = 0; j < 3; j++)
+        out[j] = hkl[0] * operation.rotation[0][j] + hkl[1] * operation.rotation[1][j] + hkl[2] * operation.rotation[2][j];
+    return out;
+}
+
+void reciprocal_metric_tensor(const UnitCell &unitCell, double metric[3][3]){
+    // Column k of the Cartesian-to-fractional matrix is the image of the k-th 
+    // Cartesian unit vector, and the Cartesian reciprocal vector of h has 
+    // components h . column_k
+    Vector3d columns[3];
+    for (int k = 0; k < 3; k++){
+        Vector3d unit (0.0, 0.0, 0.0);
+        unit[k] = 1.0;
+        unitCell.cartesianToFractional(unit, columns[k]);
+    }
+    for (int i = 0; i < 3; i++){
+        for (int j = 0; j < 3; j++){
+            metric[i][j] = 0.0;
+            for (int k = 0; k < 3; k++)
+                metric[i][j] += columns[k][i] * columns[k][j];
+        }
+    }
+}
+
+double d_star_sq(const double metric[3][3], const Vector3i &hkl){
+    double out = 0.0;
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            out += hkl[i] * metric[i][j] * hkl[j];
+    return out;
+}
+
+Vector3d lattice_vector_lengths(const UnitCell &unitCell){
+    Vector3d out;
+    for (int i = 0; i < 3; i++){
+        Vector3d fractional (0.0, 0.0, 0.0), cartesian;
+        fractional[i] = 1.0;
+        unitCell.fractionalToCartesian(fractional, cartesian);
+        out[i] = sqrt(cartesian[0] * cartesian[0] + cartesian[1] * cartesian[1] + cartesian[2] * cartesian[2]);
+    }
+    return out;
+}
+
+namespace {
+    // Shortest Cartesian length of a fractional difference vector over lattice translations
+    double lattice_distance(const UnitCell &unitCell, const Vector3d &difference){
+        Vector3d reduced;
+        for (int k = 0; k < 3; k++)
+            reduced[k] = difference[k] - round(difference[k]);
+        double out = -1.0;
+        for (int i = -1; i <= 1; i++)
+        for (int j = -1; j <= 1; j++)
+        for (int k = -1; k <= 1; k++){
+            Vector3d shifted (reduced[0] + i, reduced[1] + j, reduced[2] + k), cartesian;
+            unitCell.fractionalToCartesian(shifted, cartesian);
+            double distance = sqrt(cartesian[0] * cartesian[0] + cartesian[1] * cartesian[1] + cartesian[2] * cartesian[2]);
+            if (out < 0.0 || distance < out)
+                out = distance;
+        }
+        return out;
+    }
+}
+
+vector<pair<int, int>> find_hydrogen_parents(const Crystal &crystal, double max_distance){
+    auto is_hydrogen = [](const string &type){ return type == "H" || type == "D"; };
+    vector<pair<int, int>> out;
+    for (int h = 0; h < crystal.atoms.size(); h++){
+        if (!is_hydrogen(crystal.atoms[h].type)) continue;
+        int parent = -1;
+        double closest = max_distance;
+        for (int p = 0; p < crystal.atoms.size(); p++){
+            if (is_hydrogen(crystal.atoms[p].type)) continue;
+            Vector3d difference;
+            for (int k = 0; k < 3; k++)
+                difference[k] = crystal.atoms[h].coordinates[k] - crystal.atoms[p].coordinates[k];
+            double distance = lattice_distance(crystal.unitCell, difference);
+            if (distance < closest){
+                closest = distance;
+                parent = p;
+            }
+        }
+        if (parent >= 0)
+            out.push_back({h, parent});
+    }
+    return out;
+}
+
+vector<int> atoms_near_selection(const Crystal &crystal, const vector<bool> &selection, double radius){
+    assert(selection.size() == crystal.atoms.size());
+    vector<SymmetryOperation> operations = symmetry_operations(crystal.spaceGroup);
+    vector<int> out;
+    for (int p = 0; p < crystal.atoms.size(); p++){
+        bool near = selection[p];
+        for (int op = 0; op < operations.size() && !near; op++){
+            // Image of atom p under the operation
+            Vector3d image;
+            for (int i = 0; i < 3; i++){
+                image[i] = operations[op].translation[i];
+                for (int j = 0; j < 3; j++)
+                    image[i] += operations[op].rotation[i][j] * crystal.atoms[p].coordinates[j];
+            }
+            for (int s = 0; s < crystal.atoms.size() && !near; s++){
+                if (!selection[s]) continue;
+                Vector3d difference;
+                for (int k = 0; k < 3; k++)
+                    difference[k] = image[k] - crystal.atoms[s].coordinates[k];
+                near = lattice_distance(crystal.unitCell, difference) <= radius;
+            }
+        }
+        if (near)
+            out.push_back(p);
+    }
+    return out;
+}
+
+vector<vector<int>> neighbour_lists(const Crystal &crystal, const vector<double> &radii){
+    assert(radii.size() == crystal.atoms.size());
+    vector<SymmetryOperation> operations = symmetry_operations(crystal.spaceGroup);
+    const int nAtoms = crystal.atoms.size();
+    vector<vector<int>> out (nAtoms);
+    for (int p = 0; p < nAtoms; p++){
+        for (int s = p + 1; s < nAtoms; s++){
+            bool near = false;
+            for (int op = 0; op < operations.size() && !near; op++){
+                Vector3d difference;
+                for (int i = 0; i < 3; i++){
+                    difference[i] = operations[op].translation[i] - crystal.atoms[s].coordinates[i];
+                    for (int j = 0; j < 3; j++)
+                        difference[i] += operations[op].rotation[i][j] * crystal.atoms[p].coordinates[j];
+                }
+                near = lattice_distance(crystal.unitCell, difference) <= radii[p] + radii[s];
+            }
+            // An image of p near s means an image of s near p
+            if (near){
+                out[p].push_back(s);
+                out[s].push_back(p);
+            }
+        }
+    }
+    return out;
+}
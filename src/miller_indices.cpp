@@ -0,0 +1,198 @@
+#include "miller_indices.hpp"
+#include "crystal_geometry.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+#include "assert.hpp"
+
+using namespace std;
+using namespace discamb;
+
+
+namespace {
+
+// Reference asymmetric units of the 12 Laue classes, as defined in cctbx (sgtbx/reciprocal_space_ref_asu)
+enum class LaueClass {
+    _1b, _2_m, _mmm, _4_m, _4_mmm, _3b, _3b1m, _3bm1, _6_m, _6_mmm, _m3b, _m3bm, unknown
+};
+
+bool is_inside(LaueClass laue, int h, int k, int l){
+    switch (laue)
+    {
+    case LaueClass::_1b:
+        return l > 0 || (l == 0 && (h > 0 || (h == 0 && k >= 0)));
+    case LaueClass::_2_m:
+        return k >= 0 && (l > 0 || (l == 0 && h >= 0));
+    case LaueClass::_mmm:
+        return h >= 0 && k >= 0 && l >= 0;
+    case LaueClass::_4_m:
+    case LaueClass::_6_m:
+        return l >= 0 && ((h >= 0 && k > 0) || (h == 0 && k == 0));
+    case LaueClass::_4_mmm:
+    case LaueClass::_6_mmm:
+        return h >= k && k >= 0 && l >= 0;
+    case LaueClass::_3b:
+        return (h >= 0 && k > 0) || (h == 0 && k == 0 && l >= 0);
+    case LaueClass::_3b1m:
+        return h >= k && k >= 0 && (k > 0 || l >= 0);
+    case LaueClass::_3bm1:
+        return h >= k && k >= 0 && (h > k || l >= 0);
+    case LaueClass::_m3b:
+        return h >= 0 && ((l >= h && k > h) || (l == h && k == h));
+    case LaueClass::_m3bm:
+        return k >= l && l >= h && h >= 0;
+    default:
+        return false;
+    }
+}
+
+typedef vector<int> Rotation; // Row-major 3x3
+
+bool contains(const vector<Rotation> &group, const Rotation &rotation){
+    return find(group.begin(), group.end(), rotation) != group.end();
+}
+
+// Identify the Laue class from the rotation parts of the space group, 
+// requiring the symmetry elements to lie along the reference setting axes
+LaueClass laue_class(const vector<SymmetryOperation> &operations){
+    vector<Rotation> group;
+    for (const SymmetryOperation &op : operations){
+        Rotation r, minus_r;
+        for (int i = 0; i < 3; i++){
+            for (int j = 0; j < 3; j++){
+                r.push_back(op.rotation[i][j]);
+                minus_r.push_back(-op.rotation[i][j]);
+            }
+        }
+        if (!contains(group, r)) group.push_back(r);
+        if (!contains(group, minus_r)) group.push_back(minus_r);
+    }
+
+    const Rotation twofold_a  {1, 0, 0,   0,-1, 0,   0, 0,-1};
+    const Rotation twofold_b  {-1, 0, 0,  0, 1, 0,   0, 0,-1};
+    const Rotation fourfold_c {0,-1, 0,   1, 0, 0,   0, 0, 1};
+    const Rotation threefold_c{0,-1, 0,   1,-1, 0,   0, 0, 1};
+    const Rotation sixfold_c  {1,-1, 0,   1, 0, 0,   0, 0, 1};
+    const Rotation twofold_ab {0, 1, 0,   1, 0, 0,   0, 0,-1};
+    const Rotation twofold_amb{0,-1, 0,  -1, 0, 0,   0, 0,-1};
+    const Rotation threefold_d{0, 0, 1,   1, 0, 0,   0, 1, 0};
+
+    bool diagonal = true;
+    for (const Rotation &r : group)
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                if (i != j && r[3 * i + j] != 0) diagonal = false;
+
+    switch (group.size())
+    {
+    case 2:
+        return LaueClass::_1b;
+    case 4:
+        return contains(group, twofold_b) ? LaueClass::_2_m : LaueClass::unknown;
+    case 8:
+        if (contains(group, fourfold_c)) return LaueClass::_4_m;
+        return diagonal ? LaueClass::_mmm : LaueClass::unknown;
+    case 16:
+        return contains(group, fourfold_c) && contains(group, twofold_a) ? LaueClass::_4_mmm : LaueClass::unknown;
+    case 6:
+        return contains(group, threefold_c) ? LaueClass::_3b : LaueClass::unknown;
+    case 12:
+        if (contains(group, sixfold_c)) return LaueClass::_6_m;
+        if (!contains(group, threefold_c)) return LaueClass::unknown;
+        if (contains(group, twofold_ab)) return LaueClass::_3bm1;
+        if (contains(group, twofold_amb)) return LaueClass::_3b1m;
+        return LaueClass::unknown;
+    case 24:
+        if (contains(group, sixfold_c)) return LaueClass::_6_mmm;
+        return contains(group, threefold_d) ? LaueClass::_m3b : LaueClass::unknown;
+    case 48:
+        return contains(group, threefold_d) && contains(group, fourfold_c) ? LaueClass::_m3bm : LaueClass::unknown;
+    default:
+        return LaueClass::unknown;
+    }
+}
+
+bool is_integer(double x){
+    return abs(x - round(x)) < 1e-6;
+}
+
+bool is_systematically_absent(const vector<SymmetryOperation> &operations, const Vector3i &hkl){
+    for (const SymmetryOperation &op : operations){
+        if (!(rotate_index(op, hkl) == hkl)) continue;
+        double phase = hkl[0] * op.translation[0] + hkl[1] * op.translation[1] + hkl[2] * op.translation[2];
+        if (!is_integer(phase)) return true;
+    }
+    return false;
+}
+
+bool is_centric(const vector<SymmetryOperation> &operations, const Vector3i &hkl){
+    const Vector3i minus_hkl (-hkl[0], -hkl[1], -hkl[2]);
+    for (const SymmetryOperation &op : operations)
+        if (rotate_index(op, hkl) == minus_hkl) return true;
+    return false;
+}
+
+} // namespace
+
+
+bool generate_miller_indices(
+    const Crystal &crystal,
+    const double d_min,
+    const bool anomalous,
+    vector<Vector3i> &hkl
+){
+    assert(d_min > 0.0);
+    hkl.clear();
+
+    vector<SymmetryOperation> operations = symmetry_operations(crystal.spaceGroup);
+    LaueClass laue = laue_class(operations);
+    if (laue == LaueClass::unknown) return false;
+
+    double metric[3][3];
+    reciprocal_metric_tensor(crystal.unitCell, metric);
+    const double d_star_sq_max = 1.0 / (d_min * d_min);
+
+    // Same tolerance as cctbx's unit_cell.max_miller_indices
+    Vector3d lengths = lattice_vector_lengths(crystal.unitCell);
+    int h_max[3];
+    for (int i = 0; i < 3; i++)
+        h_max[i] = static_cast<int>(floor(lengths[i] / d_min + 1e-4));
+
+    // The last index runs fastest, as in cctbx's index_generator
+    Vector3i index;
+    for (int h = -h_max[0]; h <= h_max[0]; h++){
+        for (int k = -h_max[1]; k <= h_max[1]; k++){
+            for (int l = -h_max[2]; l <= h_max[2]; l++){
+                if (!is_inside(laue, h, k, l)) continue;
+                index = Vector3i {h, k, l};
+                double d_star_sq_hkl = d_star_sq(metric, index);
+                if (d_star_sq_hkl == 0.0 || d_star_sq_hkl > d_star_sq_max) continue;
+                if (is_systematically_absent(operations, index)) continue;
+                hkl.push_back(index);
+                // Friedel mate follows directly
+                if (anomalous && !is_centric(operations, index))
+                    hkl.push_back(Vector3i {-h, -k, -l});
+            }
+        }
+    }
+    return true;
+}
+
+void sort_indices_by_resolution(const UnitCell &unitCell, vector<Vector3i> &hkl){
+    double metric[3][3];
+    reciprocal_metric_tensor(unitCell, metric);
+
+    vector<pair<double, int>> keys (hkl.size());
+    for (int i = 0; i < hkl.size(); i++)
+        keys[i] = {d_star_sq(metric, hkl[i]), i};
+    stable_sort(keys.begin(), keys.end(), [](const pair<double, int> &a, const pair<double, int> &b){
+        return a.first < b.first;
+    });
+
+    vector<Vector3i> sorted (hkl.size());
+    for (int i = 0; i < hkl.size(); i++)
+        sorted[i] = hkl[keys[i].second];
+    hkl.swap(sorted);
+}
@@ -57,6 +57,36 @@ PYBIND11_MODULE(_wrapper, m) {
         py::arg("d_min")
     );
 
+    m.def(
+        "write_assigned_types_databank", 
+        &write_assigned_types_databank, 
+        R"pbdoc(
+        Write a TAAM databank with only the atom types assigned in the given structures
+
+        Typing with the smaller bank, e.g. through DiscambWrapper.from_TAAM_parameters,
+        is faster for repeated runs on the same structures. Types are not kept because 
+        they could match, so another member of a compound series with an environment 
+        not found in these structures gets no type from the written bank. Include all 
+        members of the series in structures.
+
+        Parameters
+        ----------
+        structures
+            List of xray-structures whose atom types are kept
+        output_filepath
+            Path of the reduced databank
+        bank_filepath
+            Databank to reduce. The default databank is used if empty
+
+        Returns
+        -------
+        Number of atom types written
+        )pbdoc",
+        py::arg("structures"),
+        py::arg("output_filepath"),
+        py::arg("bank_filepath") = ""
+    );
+
     py::enum_<FCalcMethod>(m, 
             "FCalcMethod", 
             R"pbdoc(Enum for specifying the model for atomic form factor calculations)pbdoc"
@@ -85,11 +115,45 @@ PYBIND11_MODULE(_wrapper, m) {
         .def_readwrite("occupancy_derivatives", &TargetFunctionAtomicParamDerivatives::occupancy_derivatives)
     ;
 
+    py::class_<CalculatorStats>(m, "CalculatorStats")
+        .def_readonly("n_atoms", &CalculatorStats::n_atoms)
+        .def_readonly("n_isotropic_groups", &CalculatorStats::n_isotropic_groups)
+        .def_readonly("update_time", &CalculatorStats::update_time)
+        .def_readonly("f_calc_time", &CalculatorStats::f_calc_time)
+        .def_readonly("derivatives_time", &CalculatorStats::derivatives_time)
+        .def_readonly("pruned_fraction", &CalculatorStats::pruned_fraction)
+        .def_readonly("pruning_error_bound", &CalculatorStats::pruning_error_bound)
+        .def_readonly("n_frames_updated", &CalculatorStats::n_frames_updated)
+        .def_readonly("n_typed_atoms", &CalculatorStats::n_typed_atoms)
+        .def_readonly("typing_time", &CalculatorStats::typing_time)
+    ;
+
     py::class_<DiscambWrapper>(m, 
             "DiscambWrapper", 
             R"pbdoc(Calculate structure factors using DiSCaMB)pbdoc"
         )
-        .def(py::init<py::object, FCalcMethod>(), py::arg("structure"), py::arg("method") = FCalcMethod::IAM)
+        .def(
+            py::init<py::object, FCalcMethod, bool, size_t>(), 
+            R"pbdoc(
+            Parameters
+            ----------
+            structure
+                xray-structure to calculate structure factors for
+            method
+                IAM or TAAM
+            native_kernel
+                Sum structure factors in the wrapper instead of in DiSCaMB. With TAAM, 
+                the atomic form factors are tabulated per reflection set, at 16 bytes 
+                per atom, reflection and symmetry operation. This suits small molecules, 
+                not proteins: 1000 atoms, 30000 reflections and 4 operations take about 1.9 GB
+            max_table_bytes
+                Largest TAAM form factor table. Larger reflection sets raise ValueError
+            )pbdoc",
+            py::arg("structure"), 
+            py::arg("method") = FCalcMethod::IAM, 
+            py::arg("native_kernel") = false,
+            py::arg("max_table_bytes") = size_t(1) << 31
+        )
         .def(
             "f_calc", 
             py::overload_cast<double>(&DiscambWrapper::f_calc), 
@@ -101,11 +165,162 @@ PYBIND11_MODULE(_wrapper, m) {
             py::overload_cast<>(&DiscambWrapper::f_calc), 
             R"pbdoc(Calculate the structure factors for previously set hkl)pbdoc"
         )
+        .def(
+            "f_calc", 
+            py::overload_cast<const string &>(&DiscambWrapper::f_calc), 
+            R"pbdoc(Calculate the structure factors for a named set of hkl)pbdoc",
+            py::arg("set_name")
+        )
+        .def(
+            "f_calc_multi_wavelength",
+            &DiscambWrapper::f_calc_multi_wavelength,
+            R"pbdoc(
+            Calculate the structure factors for several sets of anomalous scattering terms, 
+            e.g. one per wavelength in a MAD experiment. 
+            The contributions without anomalous terms are only calculated once.
+
+            Parameters
+            ----------
+            anomalous_sets
+                List of sets, each with one complex(fp, fdp) per scatterer
+            set_name
+                Named set of hkl to use. Previously set hkl are used if empty
+
+            Returns
+            -------
+            One list of structure factors per set of anomalous terms
+            )pbdoc",
+            py::arg("anomalous_sets"),
+            py::arg("set_name") = ""
+        )
+        .def(
+            "f_calc_joint",
+            &DiscambWrapper::f_calc_joint,
+            R"pbdoc(
+            Calculate the structure factors of the model for several radiation types, 
+            e.g. for joint X-ray and neutron refinement. The phase and Debye-Waller sums 
+            are shared, and each radiation type applies the form factors of its table.
+            Anomalous terms apply to X-ray tables only. Requires native_kernel with IAM.
+
+            Parameters
+            ----------
+            tables
+                Scattering table per radiation type, e.g. "xray", "electron" or "neutron"
+            set_name
+                Named set of hkl to use. Previously set hkl are used if empty
+
+            Returns
+            -------
+            One list of structure factors per table
+            )pbdoc",
+            py::arg("tables"),
+            py::arg("set_name") = ""
+        )
+        .def(
+            "d_target_d_params_joint",
+            &DiscambWrapper::d_target_d_params_joint,
+            py::return_value_policy::take_ownership,
+            R"pbdoc(
+            Calculate the derivatives of a weighted joint target, sum of weight * target 
+            over radiation types, sharing the phase and Debye-Waller sums as in f_calc_joint.
+
+            Parameters
+            ----------
+            tables
+                Scattering table per radiation type
+            d_target_d_f_calc
+                One list of target derivatives per table
+            weights
+                Weight per table, all 1 if empty
+            set_name
+                Named set of hkl to use. Previously set hkl are used if empty
+
+            Returns
+            -------
+            Derivatives per scatterer, as from d_target_d_params
+            )pbdoc",
+            py::arg("tables"),
+            py::arg("d_target_d_f_calc"),
+            py::arg("weights") = std::vector<double>{},
+            py::arg("set_name") = ""
+        )
+        .def(
+            "i_calc_twinned",
+            &DiscambWrapper::i_calc_twinned,
+            R"pbdoc(
+            Calculate the intensities of a twinned crystal, sum over domains of 
+            fraction * |F(h R)|^2. F is calculated once on the unique twin-related 
+            indices, which are kept between calls.
+
+            Parameters
+            ----------
+            twin_laws
+                One 3x3 integer matrix R per domain, including the identity for the 
+                reference domain. Indices are transformed as row vectors, h R
+            fractions
+                Twin fraction per domain
+            set_name
+                Named set of hkl to use. Previously set hkl are used if empty
+
+            Returns
+            -------
+            One intensity per reflection
+            )pbdoc",
+            py::arg("twin_laws"),
+            py::arg("fractions"),
+            py::arg("set_name") = ""
+        )
+        .def(
+            "d_target_d_params_twinned",
+            &DiscambWrapper::d_target_d_params_twinned,
+            R"pbdoc(
+            Calculate the derivatives of a target function of twinned intensities.
+
+            Parameters
+            ----------
+            twin_laws
+                One 3x3 integer matrix per domain, as for i_calc_twinned
+            fractions
+                Twin fraction per domain
+            d_target_d_i_calc
+                Derivative of the target with respect to each twinned intensity
+            set_name
+                Named set of hkl to use. Previously set hkl are used if empty
+
+            Returns
+            -------
+            Derivatives per scatterer, as from d_target_d_params, and the 
+            derivatives with respect to the twin fractions
+            )pbdoc",
+            py::arg("twin_laws"),
+            py::arg("fractions"),
+            py::arg("d_target_d_i_calc"),
+            py::arg("set_name") = ""
+        )
         .def(
             "d_f_calc_d_params",
-            &DiscambWrapper::d_f_calc_d_params,
+            py::overload_cast<>(&DiscambWrapper::d_f_calc_d_params),
             R"pbdoc(Calculate the structure factors, and derivatives, for previously set hkl)pbdoc"
         )
+        .def(
+            "d_f_calc_d_params",
+            py::overload_cast<vector<vector<int>>>(&DiscambWrapper::d_f_calc_d_params),
+            R"pbdoc(
+            Calculate the structure factors, and derivatives, for the given (N, 3) indices. 
+            Previously set hkl are left unchanged.
+
+            With native_kernel=True the indices are evaluated in one parallel pass. 
+            Otherwise discamb evaluates them one at a time, serially, since its 
+            calculator cannot be shared between threads.
+            )pbdoc",
+            py::arg("indices")
+        )
+        .def(
+            "d_f_calc_d_params",
+            py::overload_cast<const string &>(&DiscambWrapper::d_f_calc_d_params),
+            R"pbdoc(Calculate the structure factors, and derivatives, for a named set of hkl)pbdoc",
+            py::arg("set_name")
+        )
         .def(
             "d_f_calc_hkl_d_params",
             py::overload_cast<py::tuple>(&DiscambWrapper::d_f_calc_hkl_d_params),
@@ -124,20 +339,121 @@ PYBIND11_MODULE(_wrapper, m) {
             "d_target_d_params",
             &DiscambWrapper::d_target_d_params,
             py::return_value_policy::take_ownership,
-            R"pbdoc(Calculate the derivatives of a target function)pbdoc",
-            py::arg("d_target_d_f_calc")
+            R"pbdoc(Calculate the derivatives of a target function, for previously set hkl or a named set of hkl)pbdoc",
+            py::arg("d_target_d_f_calc"),
+            py::arg("set_name") = ""
+        )
+        .def(
+            "update_parameters",
+            &DiscambWrapper::update_parameters,
+            R"pbdoc(Read atomic parameters from the structure again, e.g. after a refinement step. Scatterers must not be added, removed or change type)pbdoc"
+        )
+        .def(
+            "set_pruning",
+            &DiscambWrapper::set_pruning,
+            R"pbdoc(
+            Approximate f_calc by skipping atoms with negligible contributions. 
+
+            The reflections are split into resolution shells with equally many reflections. 
+            In each shell, an upper bound of each atom's contribution is estimated from its 
+            form factor and ADP at the lowest-resolution reflection, and atoms with bounds 
+            below the tolerance are skipped. Derivatives are not affected.
+
+            Parameters
+            ----------
+            tolerance
+                Smallest estimated contribution to keep, in the units of f_calc. 0 disables pruning
+            n_shells
+                Number of resolution shells
+            )pbdoc",
+            py::arg("tolerance"),
+            py::arg("n_shells") = 10
+        )
+        .def(
+            "set_riding_hydrogens",
+            &DiscambWrapper::set_riding_hydrogens,
+            R"pbdoc(
+            Constrain hydrogen atoms to ride on their parent atoms. 
+
+            The current offset from the parent is kept, U_iso is u_iso_factor times 
+            U_eq of the parent, and the occupancy is that of the parent. 
+            Derivatives are chain-ruled onto the parents and only returned for free atoms, 
+            in the order given by free_atom_indices.
+
+            Parameters
+            ----------
+            riding_pairs
+                List of (riding atom index, parent index). If empty, each H or D rides on 
+                the closest non-hydrogen atom within 1.3 A in the same asymmetric unit, 
+                up to lattice translations
+            u_iso_factor
+                Ratio of the riding atom's U_iso to the parent's U_eq
+            )pbdoc",
+            py::arg("riding_pairs") = vector<pair<int, int>>(),
+            py::arg("u_iso_factor") = 1.2
+        )
+        .def(
+            "free_atom_indices",
+            &DiscambWrapper::free_atom_indices,
+            R"pbdoc(Indices of scatterers with their own parameters, in the order of the derivative arrays)pbdoc"
+        )
+        .def_property_readonly(
+            "stats",
+            &DiscambWrapper::stats,
+            R"pbdoc(Atom count, number of isotropic atom groups in the native kernel, timings in seconds of the latest update, f_calc and derivative calls, pruning results of the latest f_calc, and the number of atoms whose TAAM form factors the latest update recomputed in the native kernel)pbdoc"
         )
         .def(
             "set_indices",
             &DiscambWrapper::set_indices,
-            R"pbdoc(Set indices for calculating f_calc. Input must be iterable of tuples with three ints)pbdoc",
-            py::arg("indices")
+            R"pbdoc(Set indices for calculating f_calc. Input must be iterable of tuples with three ints. If a set name is given, the indices are stored as a named set, e.g. "work" or "free", leaving other sets unchanged)pbdoc",
+            py::arg("indices"),
+            py::arg("set_name") = ""
         )
         .def(
             "set_d_min",
             &DiscambWrapper::set_d_min,
-            R"pbdoc(Set minimum d-spacing for calculating f_calc)pbdoc",
-            py::arg("d_min")
+            R"pbdoc(Set minimum d-spacing for calculating f_calc. Optionally order the indices from low to high resolution)pbdoc",
+            py::arg("d_min"),
+            py::arg("sort_by_resolution") = false
+        )
+        .def(
+            "get_indices",
+            &DiscambWrapper::get_indices,
+            R"pbdoc(Get the indices currently used for calculating f_calc, or the indices of a named set)pbdoc",
+            py::arg("set_name") = ""
+        )
+        .def(
+            "remove_indices",
+            &DiscambWrapper::remove_indices,
+            R"pbdoc(Remove a named set of indices)pbdoc",
+            py::arg("set_name")
+        )
+        .def(
+            "reflection_set_names",
+            &DiscambWrapper::reflection_set_names,
+            R"pbdoc(Get the names of all named sets of indices)pbdoc"
+        )
+        .def_static(
+            "from_hybrid_model",
+            &DiscambWrapper::from_hybrid_model,
+            R"pbdoc(
+            Initialize a wrapper object using TAAM for selected atoms and IAM for the rest. 
+
+            Only the selection and atoms within context_radius of it, including symmetry 
+            mates, are typed. The context atoms are still summed using IAM.
+
+            Parameters
+            ----------
+            structure
+                xray-structure to use
+            taam_selection
+                One bool per scatterer, True for atoms to model with TAAM
+            context_radius
+                Distance in A from the selection within which atoms are included for typing
+            )pbdoc",
+            py::arg("structure"),
+            py::arg("taam_selection"),
+            py::arg("context_radius") = 4.0
         )
         .def_static(
             "from_TAAM_parameters",
@@ -145,6 +461,10 @@ PYBIND11_MODULE(_wrapper, m) {
             R"pbdoc(
             Initialize a wrapper object with specified TAAM parameters. 
 
+            Types are assigned in the wrapper, with residue templates for polymers, 
+            unless a log or multipole CIF path is given. DiSCaMB then types the 
+            structure itself, to write those files.
+
             Parameters
             ----------
             structure
@@ -171,6 +491,39 @@ PYBIND11_MODULE(_wrapper, m) {
             py::arg("unit_cell_charge"),
             py::arg("perform_parameter_scaling_from_unit_cell_charge")
         )
+        .def_static(
+            "from_TAAM_setup",
+            &DiscambWrapper::from_TAAM_setup,
+            R"pbdoc(
+            Initialize a TAAM wrapper object from a file written by save_TAAM_setup. 
+
+            The saved atom types, local coordinate systems and scaled multipole 
+            parameters are used as they are, so restarting a refinement neither 
+            types the structure nor reads the full bank.
+
+            Parameters
+            ----------
+            structure
+                xray-structure to use, e.g. with the sites of the latest cycle. 
+                Its atoms must be those of the saved structure, in the same order
+            setup_filepath
+                Path of the file written by save_TAAM_setup
+            native_kernel
+                Sum structure factors in the wrapper, as for DiscambWrapper
+            max_table_bytes
+                Largest TAAM form factor table with native_kernel, as for DiscambWrapper
+            )pbdoc",
+            py::arg("structure"),
+            py::arg("setup_filepath"),
+            py::arg("native_kernel") = false,
+            py::arg("max_table_bytes") = size_t(1) << 31
+        )
+        .def(
+            "save_TAAM_setup",
+            &DiscambWrapper::save_TAAM_setup,
+            R"pbdoc(Write the TAAM calculator settings, atom types, local coordinate systems and multipole parameters to a file, and a bank reduced to the atom types of the structure next to it, for from_TAAM_setup)pbdoc",
+            py::arg("setup_filepath")
+        )
     ;
 
     py::class_<GaussianScatteringParameters>(m, "GaussianScatteringParameters")
@@ -199,4 +552,11 @@ PYBIND11_MODULE(_wrapper, m) {
         py::arg("b"),
         py::arg("c")
     );
+    m_tests.def(
+        "frame_atoms", 
+        &frame_atoms,
+        R"pbdoc(For each atom, the atoms defining its TAAM local coordinate system, including itself)pbdoc",
+        py::arg("structure"),
+        py::arg("residue_templates")
+    );
 }
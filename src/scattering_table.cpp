@@ -3,6 +3,8 @@
 #include "discamb/Scattering/NGaussianFormFactorsTable.h"
 #include "discamb/BasicChemistry/periodic_table.h"
 
+#include <cctype>
+#include <mutex>
 #include <sstream>
 #include <iomanip>
 
@@ -40,6 +42,12 @@ string table_alias(string table){
 
     if (table == "electron") return "electron-cctbx";
 
+    if (table == "neutron1992") return "neutron";
+    if (table == "neutron-1992") return "neutron";
+    if (table == "neutron_news_1992") return "neutron";
+    if (table == "sears") return "neutron";
+    if (table == "Sears") return "neutron";
+
     return table;
 }
 
@@ -59,8 +67,55 @@ vector<string> get_possible_entries(string atom){
     return out;
 }
 
-map<string, GaussianScatteringParameters> get_table(string table){
-    string alias = table_alias(table);
+namespace {
+    // Bound coherent scattering lengths in fm, from V. F. Sears, Neutron News 3 (1992) 26-37.
+    // Natural isotope abundance, except for the isotope entries. Only real parts are given, 
+    // so strong absorbers (B, Cd, Sm, Eu, Gd) need f'' from the caller
+    const pair<const char *, double> NEUTRON_SCATTERING_LENGTHS[] = {
+        {"H", -3.739}, {"D", 6.671}, {"T", 4.792}, {"He", 3.26}, 
+        {"Li", -1.90}, {"Li6", 2.00}, {"Li7", -2.22}, {"Be", 7.79}, 
+        {"B", 5.30}, {"B11", 6.65}, {"C", 6.646}, {"N", 9.36}, {"O", 5.803}, {"F", 5.654}, {"Ne", 4.566}, 
+        {"Na", 3.63}, {"Mg", 5.375}, {"Al", 3.449}, {"Si", 4.1491}, {"P", 5.13}, {"S", 2.847}, {"Cl", 9.577}, {"Ar", 1.909},
+        {"K", 3.67}, {"Ca", 4.70}, {"Sc", 12.29}, {"Ti", -3.438}, {"V", -0.3824}, {"Cr", 3.635}, {"Mn", -3.73}, 
+        {"Fe", 9.45}, {"Co", 2.49}, {"Ni", 10.3}, {"Ni58", 14.4}, {"Ni60", 2.8}, {"Ni62", -8.7}, {"Cu", 7.718}, {"Zn", 5.680}, 
+        {"Ga", 7.288}, {"Ge", 8.185}, {"As", 6.58}, {"Se", 7.970}, {"Br", 6.795}, {"Kr", 7.81},
+        {"Rb", 7.09}, {"Sr", 7.02}, {"Y", 7.75}, {"Zr", 7.16}, {"Nb", 7.054}, {"Mo", 6.715}, {"Tc", 6.8}, {"Ru", 7.03}, 
+        {"Rh", 5.88}, {"Pd", 5.91}, {"Ag", 5.922}, {"Cd", 4.87}, {"In", 4.065}, {"Sn", 6.225}, {"Sb", 5.57}, {"Te", 5.80}, 
+        {"I", 5.28}, {"Xe", 4.92},
+        {"Cs", 5.42}, {"Ba", 5.07}, {"La", 8.24}, {"Ce", 4.84}, {"Pr", 4.58}, {"Nd", 7.69}, {"Pm", 12.6}, {"Sm", 0.80}, 
+        {"Eu", 7.22}, {"Gd", 6.5}, {"Tb", 7.38}, {"Dy", 16.9}, {"Ho", 8.01}, {"Er", 7.79}, {"Tm", 7.07}, {"Yb", 12.43}, 
+        {"Lu", 7.21}, {"Hf", 7.7}, {"Ta", 6.91}, {"W", 4.86}, {"Re", 9.2}, {"Os", 10.7}, {"Ir", 10.6}, {"Pt", 9.60}, 
+        {"Au", 7.63}, {"Hg", 12.692}, {"Tl", 8.776}, {"Pb", 9.405}, {"Bi", 8.532}, {"Th", 10.31}, {"U", 8.417},
+    };
+
+    map<string, GaussianScatteringParameters> neutron_table(){
+        map<string, GaussianScatteringParameters> out;
+        for (const auto &entry : NEUTRON_SCATTERING_LENGTHS){
+            GaussianScatteringParameters s;
+            s.c = entry.second;
+            out[entry.first] = s;
+        }
+        return out;
+    }
+}
+
+namespace {
+    // Fe3+ -> Fe, O- -> O
+    string strip_ionic_charge(const string &type){
+        size_t end = type.size();
+        if (end == 0 || (type[end - 1] != '+' && type[end - 1] != '-')) return type;
+        end--;
+        while (end > 0 && isdigit(static_cast<unsigned char>(type[end - 1]))) end--;
+        return type.substr(0, end);
+    }
+}
+
+bool is_neutron_table(const string &table){
+    return table_alias(table) == "neutron";
+}
+
+map<string, GaussianScatteringParameters> read_table(const string &alias){
+    if (alias == "neutron") return neutron_table();
     map<string, GaussianScatteringParameters> out;
     for (int z = 1; z < 120; z++){
         string atom = periodic_table::symbol(z);
@@ -78,6 +133,42 @@ map<string, GaussianScatteringParameters> get_table(string table){
     return out;
 }
 
+const map<string, GaussianScatteringParameters> &cached_table(const string &table){
+    // Tables are read on first use and never modified, so references stay valid for the process
+    static map<string, map<string, GaussianScatteringParameters>> tables;
+    static mutex tablesMutex;
+    const string alias = table_alias(table);
+    lock_guard<mutex> lock (tablesMutex);
+    auto found = tables.find(alias);
+    if (found == tables.end())
+        found = tables.emplace(alias, read_table(alias)).first;
+    return found->second;
+}
+
+map<string, GaussianScatteringParameters> get_table(string table){
+    return cached_table(table);
+}
+
+bool find_form_factor(const string &type, const string &table, GaussianScatteringParameters &parameters){
+    const map<string, GaussianScatteringParameters> &entries = cached_table(table);
+    auto found = entries.find(type);
+    if (found == entries.end()){
+        // Types outside the cached entry names, e.g. isotopes, go to discamb directly
+        string alias = table_alias(table);
+        if (alias != "neutron" && n_gaussian_form_factors_table::hasFormFactor(type, alias)){
+            NGaussianFormFactor ff = n_gaussian_form_factors_table::getFormFactor(type, alias);
+            ff.get_parameters(parameters.a, parameters.b, parameters.c);
+            return true;
+        }
+        // Strip charge, e.g. O1- -> O. Scattering lengths differ between isotopes, 
+        // so neutron types only lose a trailing ionic charge, and unknown isotopes such as N15 are not found
+        found = entries.find(alias == "neutron" ? strip_ionic_charge(type) : type.substr(0, type.find_first_of("0123456789+-")));
+        if (found == entries.end()) return false;
+    }
+    parameters = found->second;
+    return true;
+}
+
 string GaussianScatteringParameters::repr(){
     stringstream out;
     out << fixed << setprecision(2);
@@ -1,5 +1,7 @@
 #include "tests.hpp"
 #include "read_structure.hpp"
+#include "atom_assignment.hpp"
+#include "DiscambWrapper.hpp"
 
 #include "discamb/Scattering/NGaussianFormFactor.h"
 #include "discamb/Scattering/IamFormFactorCalculationsManager.h"
@@ -75,3 +77,7 @@ vector<complex<double>> f_calc_custom_gaussian_parameters(
     calculator.calculateStructureFactors(hkl_vector3i, sf);
     return sf;
 }
+
+vector<vector<int>> frame_atoms(py::object structure, bool residue_templates){
+    return local_coordinate_system_atoms(default_databank(), crystal_from_xray_structure(structure), residue_templates);
+}
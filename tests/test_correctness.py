@@ -243,3 +243,12 @@ if __name__ == "__main__":
         space_group, with_adps, with_occupancy, with_anomalous, atoms, scattering_table
     )
     score = get_IAM_correctness_score(xrs)
+
+
+@pytest.mark.parametrize("with_adps", ["random u_iso", "random u_aniso"])
+def test_neutron_IAM(with_adps):
+    # Negative scattering lengths for H give partial cancellation, so compare directly
+    xrs = get_random_crystal(19, with_adps, None, "no anomalous", "many weak", "neutron")
+    fcalc_cctbx = xrs.structure_factors(algorithm="direct", d_min=2).f_calc().data()
+    fcalc_discamb = pydiscamb.calculate_structure_factors_IAM(xrs, 2)
+    assert pytest.approx(list(fcalc_cctbx), rel=1e-3, abs=1e-3) == fcalc_discamb
@@ -97,3 +97,30 @@ def test_iam_vs_taam(tyrosine, hkl):
             i[2] for i in taam.site_derivatives
         ]
     assert pytest.approx(iam.occupancy_derivatives) != taam.occupancy_derivatives
+
+
+@pytest.mark.parametrize("method", [FCalcMethod.IAM, FCalcMethod.TAAM])
+def test_batched_indices(tyrosine, method):
+    w = DiscambWrapper(tyrosine, method=method)
+    stored = [(0, 1, 2), (2, 3, 4)]
+    w.set_indices(stored)
+    queried = [(1, 2, 3), (2, -2, 0), (10, 20, 30)]
+
+    batched = w.d_f_calc_d_params(queried)
+    assert [tuple(g.hkl) for g in batched] == queried
+    for g, hkl in zip(batched, queried):
+        single = w.d_f_calc_hkl_d_params(hkl)
+        assert pytest.approx(single.structure_factor) == g.structure_factor
+        assert single.occupancy_derivatives == pytest.approx(g.occupancy_derivatives)
+
+    # Stored indices are not touched
+    assert [tuple(g.hkl) for g in w.d_f_calc_d_params()] == stored
+
+
+def test_batched_indices_from_array(tyrosine):
+    import numpy as np
+
+    w = DiscambWrapper(tyrosine)
+    queried = np.array([[1, 2, 3], [4, 5, 6]])
+    grad = w.d_f_calc_d_params(queried)
+    assert [tuple(g.hkl) for g in grad] == [(1, 2, 3), (4, 5, 6)]
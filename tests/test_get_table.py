@@ -26,6 +26,11 @@ from pydiscamb import get_table
             213,
             4,
         ),
+        (
+            "neutron",
+            93,
+            0,
+        ),
         (
             "empty, non-existing table",
             0,
@@ -89,3 +94,19 @@ def test_read_table_from_structure(table):
 
     w = pydiscamb.DiscambWrapper(xrs)
     fc = w.f_calc(2)
+
+
+def test_get_table_aliases_share_entries():
+    first = get_table("xray")
+    # Modifying the returned dict must not affect later lookups
+    first.clear()
+    again = get_table("Waasmeier-Kirfel")
+    assert len(again) == 211
+    assert repr(again["C"]) == repr(get_table("wk1995")["C"])
+
+
+def test_neutron_table():
+    table = get_table("neutron")
+    assert table["H"].c < 0
+    assert table["D"].c > 0
+    assert table["Ni62"].c != table["Ni"].c
@@ -0,0 +1,86 @@
+import pytest
+
+from cctbx.array_family import flex
+
+from pydiscamb import DiscambWrapper
+
+
+def structure_in_space_group(space_group: str, anomalous: bool):
+    from cctbx.development import random_structure as cctbx_random_structure
+    from cctbx.sgtbx import space_group_info
+
+    xrs = cctbx_random_structure.xray_structure(
+        space_group_info=space_group_info(space_group),
+        elements=["Au", "C"] * 3,
+        general_positions_only=False,
+        use_u_iso=True,
+        random_u_iso=False,
+        random_occupancy=False,
+    )
+    xrs.scattering_type_registry(table="electron")
+    if anomalous:
+        xrs.shake_fdps()
+    return xrs
+
+
+@pytest.mark.parametrize(
+    "space_group",
+    [
+        "P 1",
+        "P -1",
+        "P 1 21 1",
+        "C 1 2/c 1",
+        "P 21 21 21",
+        "I 41/a",
+        "P 4/m m m",
+        "R -3",
+        "P -3 1 m",
+        "P -3 m 1",
+        "P 63/m",
+        "P 6/m m m",
+        "P a -3",
+        "F m -3 m",
+    ],
+)
+@pytest.mark.parametrize("anomalous", [False, True])
+def test_indices_match_cctbx(space_group, anomalous):
+    xrs = structure_in_space_group(space_group, anomalous)
+    d_min = 3.0
+    expected = list(
+        xrs.build_miller_set(anomalous_flag=anomalous, d_min=d_min).indices()
+    )
+
+    w = DiscambWrapper(xrs)
+    w.set_d_min(d_min)
+    assert w.get_indices() == expected
+
+
+def test_non_reference_setting():
+    xrs = structure_in_space_group("P 1 21/n 1", False)
+    expected = list(xrs.build_miller_set(anomalous_flag=False, d_min=3.0).indices())
+
+    w = DiscambWrapper(xrs)
+    w.set_d_min(3.0)
+    assert w.get_indices() == expected
+
+
+def test_sort_by_resolution(random_structure):
+    w = DiscambWrapper(random_structure)
+    w.set_d_min(3.0)
+    unsorted = w.get_indices()
+    w.set_d_min(3.0, sort_by_resolution=True)
+    indices = w.get_indices()
+
+    assert sorted(indices) == sorted(unsorted)
+    d_spacings = random_structure.unit_cell().d(flex.miller_index(indices))
+    assert all(a >= b for a, b in zip(d_spacings, d_spacings[1:]))
+
+
+def test_anomalous_flag_follows_update_parameters():
+    xrs = structure_in_space_group("P 21 21 21", False)
+    w = DiscambWrapper(xrs)
+    xrs.shake_fdps()
+    w.update_parameters()
+    w.set_d_min(3.0)
+    expected = list(xrs.build_miller_set(anomalous_flag=True, d_min=3.0).indices())
+    assert w.get_indices() == expected
@@ -0,0 +1,274 @@
+import pytest
+import numpy as np
+
+from pydiscamb import DiscambWrapper, FCalcMethod
+
+
+@pytest.mark.parametrize(
+    "structure_fixture",
+    ["random_structure", "random_structure_u_iso", "random_structure_u_aniso", "tyrosine"],
+)
+def test_f_calc(structure_fixture, request):
+    structure = request.getfixturevalue(structure_fixture)
+    expected = DiscambWrapper(structure).f_calc(2.0)
+    actual = DiscambWrapper(structure, native_kernel=True).f_calc(2.0)
+    assert pytest.approx(np.array(expected), rel=1e-4, abs=1e-4) == np.array(actual)
+
+
+@pytest.mark.parametrize(
+    "structure_fixture", ["random_structure_u_iso", "random_structure_u_aniso"]
+)
+def test_d_f_calc_d_params(structure_fixture, request):
+    structure = request.getfixturevalue(structure_fixture)
+    wrappers = [DiscambWrapper(structure), DiscambWrapper(structure, native_kernel=True)]
+    expected, actual = [w.d_f_calc_d_params([(1, 2, 3), (-2, 0, 5)]) for w in wrappers]
+    for e, a in zip(expected, actual):
+        assert pytest.approx(e.structure_factor, rel=1e-4) == a.structure_factor
+        assert pytest.approx(np.array(e.site_derivatives), rel=1e-4, abs=1e-4) == np.array(a.site_derivatives)
+        assert pytest.approx(np.array(e.adp_derivatives), rel=1e-4, abs=1e-4) == np.array(a.adp_derivatives)
+        assert pytest.approx(e.occupancy_derivatives, rel=1e-4, abs=1e-4) == a.occupancy_derivatives
+
+
+@pytest.mark.parametrize(
+    "structure_fixture", ["random_structure_u_iso", "random_structure_u_aniso"]
+)
+def test_d_target_d_params(structure_fixture, request):
+    structure = request.getfixturevalue(structure_fixture)
+    wrappers = [DiscambWrapper(structure), DiscambWrapper(structure, native_kernel=True)]
+    for w in wrappers:
+        w.set_d_min(2.0)
+    d_target_d_f_calc = [complex(i % 7, -(i % 3)) for i in range(len(wrappers[0].get_indices()))]
+    expected, actual = [w.d_target_d_params(d_target_d_f_calc) for w in wrappers]
+    for e, a in zip(expected, actual):
+        assert pytest.approx(e.site_derivatives, rel=1e-4, abs=1e-3) == a.site_derivatives
+        assert pytest.approx(e.adp_derivatives, rel=1e-4, abs=1e-3) == a.adp_derivatives
+        assert pytest.approx(e.occupancy_derivatives, rel=1e-4, abs=1e-3) == a.occupancy_derivatives
+
+
+def test_grouping(tyrosine):
+    w = DiscambWrapper(tyrosine, native_kernel=True)
+    # Five distinct B in the model, and N, C, O, H
+    assert w.stats.n_atoms == tyrosine.scatterers().size()
+    assert w.stats.n_isotropic_groups < w.stats.n_atoms
+
+    tyrosine.set_b_iso(value=20.0)
+    w.update_parameters()
+    assert w.stats.n_isotropic_groups == 4
+    assert pytest.approx(DiscambWrapper(tyrosine).f_calc(2.0), rel=1e-4, abs=1e-4) == w.f_calc(2.0)
+
+
+def test_update_parameters_without_kernel(random_structure):
+    w = DiscambWrapper(random_structure)
+    sf_before = w.f_calc(3.0)
+    site = random_structure.scatterers()[0].site
+    random_structure.scatterers()[0].site = (site[2], site[1], site[0])
+    w.update_parameters()
+    assert not pytest.approx(sf_before) == w.f_calc(3.0)
+    assert w.stats.n_isotropic_groups == 0
+
+
+def test_taam_tabulated(tyrosine):
+    reference = DiscambWrapper(tyrosine, FCalcMethod.TAAM)
+    w = DiscambWrapper(tyrosine, FCalcMethod.TAAM, native_kernel=True)
+    assert pytest.approx(reference.f_calc(2.0), rel=1e-4, abs=1e-4) == w.f_calc(2.0)
+
+    d_target_d_f_calc = [complex(i % 5, 1) for i in range(len(w.get_indices()))]
+    expected, actual = [x.d_target_d_params(d_target_d_f_calc) for x in (reference, w)]
+    for e, a in zip(expected, actual):
+        assert pytest.approx(e.site_derivatives, rel=1e-4, abs=1e-3) == a.site_derivatives
+        assert pytest.approx(e.adp_derivatives, rel=1e-4, abs=1e-3) == a.adp_derivatives
+
+    # The table is redone after moving atoms
+    tyrosine.shake_sites_in_place(rms_difference=0.1)
+    reference = DiscambWrapper(tyrosine, FCalcMethod.TAAM)
+    w.update_parameters()
+    assert pytest.approx(reference.f_calc(2.0), rel=1e-4, abs=1e-4) == w.f_calc(2.0)
+
+
+def test_reflection_sets_u_aniso(random_structure_u_aniso):
+    reference = DiscambWrapper(random_structure_u_aniso)
+    w = DiscambWrapper(random_structure_u_aniso, native_kernel=True)
+    w.set_d_min(3.0, sort_by_resolution=True)
+    reference.set_d_min(3.0, sort_by_resolution=True)
+    w.set_indices([(1, 2, 3), (3, -1, 4)], "free")
+    assert pytest.approx(reference.f_calc(), rel=1e-4, abs=1e-4) == w.f_calc()
+    reference.set_indices([(1, 2, 3), (3, -1, 4)])
+    assert pytest.approx(reference.f_calc(), rel=1e-4, abs=1e-4) == w.f_calc("free")
+
+    # Replacing a set must not reuse data prepared for the old indices
+    w.set_indices([(0, 0, 2)], "free")
+    reference.set_indices([(0, 0, 2)])
+    assert pytest.approx(reference.f_calc(), rel=1e-4, abs=1e-4) == w.f_calc("free")
+
+
+def test_taam_tabulated_partial_update(tyrosine):
+    w = DiscambWrapper(tyrosine, FCalcMethod.TAAM, native_kernel=True)
+    w.set_d_min(2.0)
+    w.set_indices([(1, 2, 3), (-2, 1, 0)], "free")
+    w.f_calc()
+    w.f_calc("free")
+
+    # Only the frames involving the moved atom are redone, in every set
+    x, y, z = tyrosine.scatterers()[3].site
+    tyrosine.scatterers()[3].site = (x + 0.01, y, z - 0.01)
+    w.update_parameters()
+    reference = DiscambWrapper(tyrosine, FCalcMethod.TAAM)
+    assert pytest.approx(reference.f_calc(2.0), rel=1e-4, abs=1e-4) == w.f_calc()
+    reference.set_indices([(1, 2, 3), (-2, 1, 0)])
+    assert pytest.approx(reference.f_calc(), rel=1e-4, abs=1e-4) == w.f_calc("free")
+
+
+def test_taam_tabulated_update_counts(tyrosine):
+    w = DiscambWrapper(tyrosine, FCalcMethod.TAAM, native_kernel=True)
+    w.f_calc(2.0)
+
+    tyrosine.set_b_iso(value=15.0)
+    w.update_parameters()
+    assert w.stats.n_frames_updated == 0
+    assert pytest.approx(DiscambWrapper(tyrosine, FCalcMethod.TAAM).f_calc(2.0), rel=1e-4, abs=1e-4) == w.f_calc()
+
+    x, y, z = tyrosine.scatterers()[0].site
+    tyrosine.scatterers()[0].site = (x, y + 0.01, z)
+    w.update_parameters()
+    assert 0 < w.stats.n_frames_updated < w.stats.n_atoms
+    assert pytest.approx(DiscambWrapper(tyrosine, FCalcMethod.TAAM).f_calc(2.0), rel=1e-4, abs=1e-4) == w.f_calc()
+
+
+@pytest.mark.parametrize("table", ["electron", "wk1995"])
+def test_taam_tabulated_tables(tyrosine, table):
+    # Electron tables convert X-ray form factors in the wrapper
+    tyrosine.scattering_type_registry(table=table)
+    reference = DiscambWrapper(tyrosine, FCalcMethod.TAAM)
+    w = DiscambWrapper(tyrosine, FCalcMethod.TAAM, native_kernel=True)
+    assert pytest.approx(reference.f_calc(2.0), rel=1e-4, abs=1e-4) == w.f_calc(2.0)
+
+
+def test_taam_tabulated_typed_once(tyrosine):
+    # The calculator and the frames share one type assignment
+    w = DiscambWrapper(tyrosine, FCalcMethod.TAAM, native_kernel=True)
+    assert w.stats.n_typed_atoms == w.stats.n_atoms
+    assert w.stats.typing_time > 0
+
+
+def test_taam_tabulated_mott_bethe_origin(tyrosine):
+    w = DiscambWrapper(tyrosine, FCalcMethod.TAAM, native_kernel=True)
+    w.set_indices([(0, 0, 0)])
+    with pytest.raises(ValueError):
+        w.f_calc()
+
+
+def test_taam_tabulated_table_limit(tyrosine):
+    expected = DiscambWrapper(tyrosine, FCalcMethod.TAAM, native_kernel=True).f_calc(2.0)
+    w = DiscambWrapper(tyrosine, FCalcMethod.TAAM, native_kernel=True, max_table_bytes=1024)
+    with pytest.raises(ValueError):
+        w.f_calc(2.0)
+    w = DiscambWrapper(tyrosine, FCalcMethod.TAAM, native_kernel=True, max_table_bytes=1 << 40)
+    assert pytest.approx(expected) == w.f_calc(2.0)
+
+
+def test_taam_tabulated_mott_bethe_anomalous(tyrosine):
+    # f' and f'' are X-ray terms, and are not converted to electron scattering
+    w = DiscambWrapper(tyrosine, FCalcMethod.TAAM, native_kernel=True)
+    tyrosine.scatterers()[0].fp = -0.5
+    with pytest.raises(AssertionError):
+        w.update_parameters()
+    with pytest.raises(AssertionError):
+        DiscambWrapper(tyrosine, FCalcMethod.TAAM, native_kernel=True)
+
+
+def test_taam_tabulated_mott_bethe_hydrogen_isotopes(tyrosine):
+    # Deuterium and tritium have the nuclear charge of hydrogen
+    expected = DiscambWrapper(tyrosine, FCalcMethod.TAAM, native_kernel=True).f_calc(2.0)
+    hydrogens = [sc for sc in tyrosine.scatterers() if sc.scattering_type == "H"]
+    for i, sc in enumerate(hydrogens):
+        sc.scattering_type = "D" if i % 2 == 0 else "T"
+    actual = DiscambWrapper(tyrosine, FCalcMethod.TAAM, native_kernel=True).f_calc(2.0)
+    assert pytest.approx(np.array(expected), rel=1e-4, abs=1e-4) == np.array(actual)
+
+
+def test_neutron_uses_kernel(random_structure_u_iso):
+    # Neutron tables are not known to discamb, so the kernel is used without asking
+    random_structure_u_iso.scattering_type_registry(table="neutron")
+    w = DiscambWrapper(random_structure_u_iso)
+    assert w.stats.n_isotropic_groups > 0
+    expected = random_structure_u_iso.structure_factors(algorithm="direct", d_min=2.0).f_calc()
+    w.set_indices(expected.indices())
+    derivatives = w.d_f_calc_d_params()
+    assert pytest.approx(list(expected.data()), rel=1e-3, abs=1e-3) == [d.structure_factor for d in derivatives]
+    with pytest.raises(AssertionError):
+        w.set_pruning(1e-3)
+
+
+def test_neutron_isotopes_and_ions(random_structure_u_iso):
+    # Ionic charge does not change the scattering length, but the isotope does
+    random_structure_u_iso.scattering_type_registry(table="neutron")
+    sc = random_structure_u_iso.scatterers()[0]
+    sc.scattering_type = "O"
+    expected = DiscambWrapper(random_structure_u_iso).f_calc(2.0)
+    sc.scattering_type = "O2-"
+    assert pytest.approx(expected) == DiscambWrapper(random_structure_u_iso).f_calc(2.0)
+    sc.scattering_type = "N15"
+    with pytest.raises(AssertionError):
+        DiscambWrapper(random_structure_u_iso)
+
+
+def test_joint_radiation(random_structure_u_aniso):
+    tables = ["wk1995", "electron", "neutron"]
+    w = DiscambWrapper(random_structure_u_aniso, native_kernel=True)
+    w.set_d_min(2.0)
+    references = []
+    for table in tables:
+        structure = random_structure_u_aniso.deep_copy_scatterers()
+        structure.scattering_type_registry(table=table)
+        reference = DiscambWrapper(structure, native_kernel=True)
+        reference.set_indices(w.get_indices())
+        references.append(reference)
+
+    joint = w.f_calc_joint(tables)
+    for f, reference in zip(joint, references):
+        assert pytest.approx(reference.f_calc(), rel=1e-6, abs=1e-6) == f
+
+    weights = [1.0, 0.5, 2.0]
+    d_target_d_f_calc = [[complex(i % (r + 3), 1) for i in range(len(joint[0]))] for r in range(len(tables))]
+    actual = w.d_target_d_params_joint(tables, d_target_d_f_calc, weights)
+    separate = [r.d_target_d_params(d) for r, d in zip(references, d_target_d_f_calc)]
+    for atom, a in enumerate(actual):
+        expected_sites = sum(weight * np.array(s[atom].site_derivatives) for weight, s in zip(weights, separate))
+        expected_adps = sum(weight * np.array(s[atom].adp_derivatives) for weight, s in zip(weights, separate))
+        assert pytest.approx(expected_sites, rel=1e-6, abs=1e-6) == np.array(a.site_derivatives)
+        assert pytest.approx(expected_adps, rel=1e-6, abs=1e-6) == np.array(a.adp_derivatives)
+
+
+@pytest.mark.parametrize("structure_fixture", ["random_structure_u_iso", "random_structure_u_aniso"])
+def test_sparse_anomalous(structure_fixture, request):
+    # Only one atom takes the complex path
+    structure = request.getfixturevalue(structure_fixture)
+    structure.scatterers()[0].fp = -1.5
+    structure.scatterers()[0].fdp = 3.2
+    wrappers = [DiscambWrapper(structure), DiscambWrapper(structure, native_kernel=True)]
+    expected, actual = [w.f_calc(2.0) for w in wrappers]
+    assert pytest.approx(expected, rel=1e-4, abs=1e-4) == actual
+
+    expected, actual = [w.d_f_calc_d_params([(1, 2, 3), (-2, 0, 5)]) for w in wrappers]
+    for e, a in zip(expected, actual):
+        assert pytest.approx(e.structure_factor, rel=1e-4) == a.structure_factor
+        assert pytest.approx(np.array(e.site_derivatives), rel=1e-4, abs=1e-4) == np.array(a.site_derivatives)
+        assert pytest.approx(np.array(e.adp_derivatives), rel=1e-4, abs=1e-4) == np.array(a.adp_derivatives)
+
+
+def test_grouped_matches_ungrouped(random_structure_u_iso):
+    random_structure_u_iso.set_u_iso(value=0.02)
+    grouped = DiscambWrapper(random_structure_u_iso, native_kernel=True)
+    # Differences far below the tolerance split every group
+    for i, sc in enumerate(random_structure_u_iso.scatterers()):
+        sc.u_iso = 0.02 + i * 1e-14
+    ungrouped = DiscambWrapper(random_structure_u_iso, native_kernel=True)
+    assert grouped.stats.n_isotropic_groups < ungrouped.stats.n_isotropic_groups
+    assert ungrouped.stats.n_isotropic_groups == ungrouped.stats.n_atoms
+
+    assert pytest.approx(ungrouped.f_calc(2.0), rel=1e-9, abs=1e-9) == grouped.f_calc(2.0)
+    d_target_d_f_calc = [complex(i % 3, -1) for i in range(len(grouped.get_indices()))]
+    expected, actual = [w.d_target_d_params(d_target_d_f_calc) for w in (ungrouped, grouped)]
+    for e, a in zip(expected, actual):
+        assert pytest.approx(e.site_derivatives, rel=1e-9, abs=1e-9) == a.site_derivatives
+        assert pytest.approx(e.adp_derivatives, rel=1e-9, abs=1e-9) == a.adp_derivatives
@@ -1,3 +1,5 @@
+import json
+
 import pytest
 
 import pydiscamb
@@ -83,3 +85,147 @@ def test_unit_cell_charge_scaling_off(tyrosine):
         tyrosine, False, bank, "", "", "", 0, False
     )
     assert pytest.approx(w1.f_calc(2)) == w2.f_calc(2)
+
+
+def test_hybrid_model_limits(tyrosine):
+    n = tyrosine.scatterers().size()
+    d_min = 2.0
+    iam = pydiscamb.DiscambWrapper(tyrosine).f_calc(d_min)
+    # The hybrid model keeps the bank populations, as without charge scaling
+    taam = pydiscamb.DiscambWrapper.from_TAAM_parameters(
+        tyrosine, True, pydiscamb.taam_parameters.get_default_databank(), "", "", "", 0, False
+    ).f_calc(d_min)
+
+    none = pydiscamb.DiscambWrapper.from_hybrid_model(tyrosine, [False] * n)
+    assert pytest.approx(iam) == none.f_calc(d_min)
+    every = pydiscamb.DiscambWrapper.from_hybrid_model(tyrosine, [True] * n)
+    assert pytest.approx(taam, rel=1e-4) == every.f_calc(d_min)
+
+
+def test_hybrid_model_side_chain(tyrosine):
+    # Side chain atoms CB to OH and their hydrogens with TAAM, the rest with IAM
+    n = tyrosine.scatterers().size()
+    selection = [i in range(4, 12) or i in range(17, 24) for i in range(n)]
+    w = pydiscamb.DiscambWrapper.from_hybrid_model(tyrosine, selection)
+    f_calc = w.f_calc(2.0)
+    iam_f_calc = pydiscamb.DiscambWrapper(tyrosine).f_calc(2.0)
+    assert f_calc != pytest.approx(iam_f_calc)
+
+    derivatives = w.d_target_d_params([1.0 + 0j] * len(f_calc))
+    assert len(derivatives) == n
+    single = w.d_f_calc_hkl_d_params(1, 2, 3)
+    assert len(single.site_derivatives) == n
+
+
+def test_hybrid_model_matches_full_taam(tyrosine):
+    # The selected atoms contribute as in a full TAAM model without charge scaling. 
+    # The other atoms are masked with zero occupancy in both
+    n = tyrosine.scatterers().size()
+    selection = [i in range(4, 12) or i in range(17, 24) for i in range(n)]
+    for sc, selected in zip(tyrosine.scatterers(), selection):
+        if not selected:
+            sc.occupancy = 0
+    hybrid = pydiscamb.DiscambWrapper.from_hybrid_model(tyrosine, selection)
+    full = pydiscamb.DiscambWrapper.from_TAAM_parameters(
+        tyrosine, True, pydiscamb.taam_parameters.get_default_databank(), "", "", "", 0, False
+    )
+    assert pytest.approx(full.f_calc(2.0), rel=1e-4, abs=1e-4) == hybrid.f_calc(2.0)
+
+
+def test_typing_stats(tyrosine, lysozyme, tmp_path):
+    w = pydiscamb.DiscambWrapper(tyrosine, pydiscamb.FCalcMethod.TAAM)
+    assert w.stats.n_typed_atoms == w.stats.n_atoms
+    assert w.stats.typing_time > 0
+
+    # Writing logs leaves the typing to discamb
+    logged = pydiscamb.DiscambWrapper.from_TAAM_parameters(
+        tyrosine, True, pydiscamb.taam_parameters.get_default_databank(), 
+        str(tmp_path / "assignment.log"), "", "", 0, True
+    )
+    assert logged.stats.n_typed_atoms == 0
+    assert pytest.approx(logged.f_calc(2.0), rel=1e-4, abs=1e-4) == w.f_calc(2.0)
+
+    # Setup time of a protein, typed with residue templates, shown with pytest -s
+    w = pydiscamb.DiscambWrapper(lysozyme, pydiscamb.FCalcMethod.TAAM)
+    assert w.stats.typing_time > 0
+    print(f"lysozyme: {w.stats.n_typed_atoms} atoms typed for {w.stats.n_atoms} in {w.stats.typing_time:.2f} s")
+
+
+def test_residue_templates(lysozyme):
+    expected = pydiscamb.wrapper_tests.frame_atoms(lysozyme, residue_templates=False)
+    actual = pydiscamb.wrapper_tests.frame_atoms(lysozyme, residue_templates=True)
+    assert actual == expected
+
+
+def test_reduced_databank(tyrosine, tmp_path):
+    bank = pydiscamb.taam_parameters.get_default_databank()
+    reduced = str(tmp_path / "reduced_databank.txt")
+    n_types = pydiscamb.write_assigned_types_databank([tyrosine], reduced)
+    assert 0 < n_types <= tyrosine.scatterers().size()
+
+    w1, w2 = [
+        pydiscamb.DiscambWrapper.from_TAAM_parameters(
+            tyrosine, False, b, "", "", "", 0, False
+        )
+        for b in (bank, reduced)
+    ]
+    assert pytest.approx(w1.f_calc(2)) == w2.f_calc(2)
+
+    with pytest.raises(AssertionError):
+        pydiscamb.write_assigned_types_databank([tyrosine], reduced, str(tmp_path / "missing.txt"))
+
+
+def test_TAAM_setup(tyrosine, tmp_path):
+    setup = str(tmp_path / "taam_setup.json")
+    w1 = pydiscamb.DiscambWrapper.from_TAAM_parameters(
+        tyrosine,
+        False,
+        pydiscamb.taam_parameters.get_default_databank(),
+        "",
+        "",
+        str(tmp_path / "multipoles.cif"),
+        0,
+        False,
+    )
+    w1.save_TAAM_setup(setup)
+    assert (tmp_path / "taam_setup.json.bank.txt").exists()
+    with open(setup) as f:
+        saved = json.load(f)
+    assert saved["multipole cif"] == str(tmp_path / "multipoles.cif")
+    assert len(saved["assignment"]["types"]) == tyrosine.scatterers().size()
+
+    w2 = pydiscamb.DiscambWrapper.from_TAAM_setup(tyrosine, setup)
+    assert pytest.approx(w1.f_calc(2)) == w2.f_calc(2)
+
+
+def test_TAAM_setup_requires_taam(tyrosine, tmp_path):
+    w = pydiscamb.DiscambWrapper(tyrosine)
+    with pytest.raises(AssertionError):
+        w.save_TAAM_setup(str(tmp_path / "taam_setup.json"))
+
+
+def test_TAAM_setup_from_default_bank(tyrosine, tmp_path):
+    setup = str(tmp_path / "taam_setup.json")
+    w1 = pydiscamb.DiscambWrapper(tyrosine, pydiscamb.FCalcMethod.TAAM)
+    w1.save_TAAM_setup(setup)
+    w2 = pydiscamb.DiscambWrapper.from_TAAM_setup(tyrosine, setup)
+    assert pytest.approx(w1.f_calc(2)) == w2.f_calc(2)
+
+
+def test_TAAM_setup_restored_without_typing(tyrosine, tmp_path):
+    setup = str(tmp_path / "taam_setup.json")
+    w1 = pydiscamb.DiscambWrapper(tyrosine, pydiscamb.FCalcMethod.TAAM, native_kernel=True)
+    assert w1.stats.n_typed_atoms == w1.stats.n_atoms
+    w1.save_TAAM_setup(setup)
+
+    # Types, frames and scaled parameters are read back, not assigned again
+    w2 = pydiscamb.DiscambWrapper.from_TAAM_setup(tyrosine, setup, native_kernel=True)
+    assert w2.stats.n_typed_atoms == 0
+    assert pytest.approx(w1.f_calc(2), rel=1e-12, abs=1e-12) == w2.f_calc(2)
+
+    w3 = pydiscamb.DiscambWrapper.from_TAAM_setup(tyrosine, setup)
+    assert pytest.approx(w1.f_calc(2), rel=1e-4, abs=1e-4) == w3.f_calc(2)
+
+    limited = pydiscamb.DiscambWrapper.from_TAAM_setup(tyrosine, setup, native_kernel=True, max_table_bytes=1024)
+    with pytest.raises(ValueError):
+        limited.f_calc(2)
@@ -2,6 +2,7 @@ import pytest
 import numpy as np
 
 from cctbx.array_family import flex
+from cctbx import adptbx
 import mmtbx.f_model
 
 from pydiscamb import DiscambWrapper
@@ -111,3 +112,118 @@ class TestTargetGradients:
         with pytest.raises(AssertionError):
             # Supply incorrect length list
             w.d_target_d_params(list(d_target_d_fcalc.data())[1:])
+
+
+def _nearest_parents(structure, hydrogens):
+    sites = structure.sites_cart()
+    parents = {}
+    for h in hydrogens:
+        distances = [
+            (sites[h][0] - sites[p][0]) ** 2
+            + (sites[h][1] - sites[p][1]) ** 2
+            + (sites[h][2] - sites[p][2]) ** 2
+            if p not in hydrogens
+            else np.inf
+            for p in range(sites.size())
+        ]
+        parents[h] = int(np.argmin(distances))
+    return parents
+
+
+def test_riding_hydrogens(tyrosine):
+    scatterers = tyrosine.scatterers()
+    riding = DiscambWrapper(tyrosine)
+    riding.set_riding_hydrogens()
+
+    hydrogens = [i for i, sc in enumerate(scatterers) if sc.scattering_type == "H"]
+    assert riding.free_atom_indices() == [
+        i for i in range(scatterers.size()) if i not in hydrogens
+    ]
+
+    # Make the unconstrained model satisfy the constraints, using the same parents
+    parents = _nearest_parents(tyrosine, hydrogens)
+    for h in hydrogens:
+        scatterers[h].u_iso = 1.2 * scatterers[parents[h]].u_iso
+        scatterers[h].occupancy = scatterers[parents[h]].occupancy
+    free = DiscambWrapper(tyrosine)
+    free.set_d_min(2.0)
+    riding.set_d_min(2.0)
+    assert pytest.approx(free.f_calc(), rel=1e-5) == riding.f_calc()
+
+    d_target_d_f_calc = [complex(1.0, 0.5)] * len(free.get_indices())
+    expected = free.d_target_d_params(d_target_d_f_calc)
+    actual = riding.d_target_d_params(d_target_d_f_calc)
+    assert len(actual) == scatterers.size() - len(hydrogens)
+
+    site = {i: np.array(expected[i].site_derivatives) for i in range(len(expected))}
+    adp = {i: expected[i].adp_derivatives[0] for i in range(len(expected))}
+    occupancy = {i: expected[i].occupancy_derivatives for i in range(len(expected))}
+    for h, p in parents.items():
+        site[p] = site[p] + site[h]
+        adp[p] += 1.2 * adp[h]
+        occupancy[p] += occupancy[h]
+    for res, i in zip(actual, riding.free_atom_indices()):
+        assert pytest.approx(site[i], rel=1e-5, abs=1e-6) == np.array(res.site_derivatives)
+        assert pytest.approx(adp[i], rel=1e-5, abs=1e-6) == res.adp_derivatives[0]
+        assert pytest.approx(occupancy[i], rel=1e-5, abs=1e-6) == res.occupancy_derivatives
+
+
+@pytest.mark.parametrize("first_atom_isotropic", [False, True])
+def test_riding_hydrogens_anisotropic_parents(tyrosine, first_atom_isotropic):
+    # With the first atom isotropic the structure is mixed, which must not
+    # change how the parents' u_star are read
+    scatterers = tyrosine.scatterers()
+    unit_cell = tyrosine.unit_cell()
+    hydrogens = [i for i, sc in enumerate(scatterers) if sc.scattering_type == "H"]
+    anisotropic = [
+        i not in hydrogens and not (first_atom_isotropic and i == 0)
+        for i in range(scatterers.size())
+    ]
+    tyrosine.convert_to_anisotropic(selection=flex.bool(anisotropic))
+    for i, sc in enumerate(scatterers):
+        if anisotropic[i]:
+            u = sc.u_iso_or_equiv(unit_cell)
+            sc.u_star = adptbx.u_cart_as_u_star(
+                unit_cell, (1.4 * u, 0.9 * u, 0.7 * u, 0.1 * u, -0.05 * u, 0.08 * u)
+            )
+
+    riding = DiscambWrapper(tyrosine)
+    riding.set_riding_hydrogens()
+
+    parents = _nearest_parents(tyrosine, hydrogens)
+    for h in hydrogens:
+        scatterers[h].u_iso = 1.2 * scatterers[parents[h]].u_iso_or_equiv(unit_cell)
+        scatterers[h].occupancy = scatterers[parents[h]].occupancy
+    free = DiscambWrapper(tyrosine)
+    free.set_d_min(2.0)
+    riding.set_d_min(2.0)
+    assert pytest.approx(free.f_calc(), rel=1e-5) == riding.f_calc()
+
+    # U_eq is a third of the trace of U_cart, so a riding atom's U_iso
+    # derivative spreads over the parent's diagonal
+    d_target_d_f_calc = [complex(1.0, 0.5)] * len(free.get_indices())
+    expected = free.d_target_d_params(d_target_d_f_calc)
+    actual = riding.d_target_d_params(d_target_d_f_calc)
+    adp = {i: np.array(expected[i].adp_derivatives) for i in range(len(expected))}
+    for h, p in parents.items():
+        if anisotropic[p]:
+            adp[p][:3] += 1.2 * adp[h][0] / 3
+        else:
+            adp[p][0] += 1.2 * adp[h][0]
+    for res, i in zip(actual, riding.free_atom_indices()):
+        assert pytest.approx(adp[i], rel=1e-5, abs=1e-6) == np.array(res.adp_derivatives)
+
+    # The per-reflection derivatives stay in u_star
+    u_eq_gradient = np.array(
+        [
+            sum(adptbx.u_star_as_u_cart(unit_cell, tuple(float(j == k) for j in range(6)))[:3]) / 3
+            for k in range(6)
+        ]
+    )
+    free_indices = riding.free_atom_indices()
+    for e, a in zip(free.d_f_calc_d_params(), riding.d_f_calc_d_params()):
+        adp = [np.array(d) for d in e.adp_derivatives]
+        for h, p in parents.items():
+            adp[p] += 1.2 * adp[h][0] * (u_eq_gradient if anisotropic[p] else 1.0)
+        for j, i in enumerate(free_indices):
+            assert pytest.approx(adp[i], rel=1e-5, abs=1e-6) == np.array(a.adp_derivatives[j])
@@ -106,3 +106,155 @@ def test_anomalous_scattering(p: bool, dp: bool, random_structure):
     assert not pytest.approx(rb) == ra
     assert not pytest.approx(ib) == ia
     assert not pytest.approx(b) == a
+
+
+def test_named_reflection_sets(random_structure):
+    from pydiscamb import DiscambWrapper
+
+    work = [(0, 1, 2), (1, 1, 1), (2, 3, 4)]
+    free = [(1, 0, 0), (3, 2, 1)]
+
+    w = DiscambWrapper(random_structure)
+    w.set_indices(work, "work")
+    w.set_indices(free, "free")
+    assert sorted(w.reflection_set_names()) == ["free", "work"]
+    assert w.get_indices("work") == work
+    assert len(w.f_calc()) == 0
+
+    reference = DiscambWrapper(random_structure)
+    reference.set_indices(work)
+    assert pytest.approx(reference.f_calc()) == w.f_calc("work")
+    reference.set_indices(free)
+    assert pytest.approx(reference.f_calc()) == w.f_calc("free")
+
+    grad = w.d_f_calc_d_params("free")
+    assert [tuple(g.hkl) for g in grad] == free
+
+    target = w.d_target_d_params([1 + 0j] * len(work), "work")
+    assert len(target) == random_structure.scatterers().size()
+
+    w.remove_indices("free")
+    assert w.reflection_set_names() == ["work"]
+    with pytest.raises(IndexError):
+        w.f_calc("free")
+
+
+@pytest.mark.parametrize("native_kernel", [False, True])
+def test_multi_wavelength(random_structure, native_kernel):
+    from pydiscamb import DiscambWrapper
+
+    scatterers = random_structure.scatterers()
+    # Anomalous terms of the model itself are replaced by those of each set
+    for sc in scatterers:
+        if sc.scattering_type == "Au":
+            sc.fp, sc.fdp = -1.0, 2.0
+    anomalous_sets = [
+        [complex(0, 0)] * scatterers.size(),
+        [complex(-2.0, 4.0) if sc.scattering_type == "Au" else 0j for sc in scatterers],
+        [complex(-8.0, 1.5) if sc.scattering_type == "Au" else 0j for sc in scatterers],
+    ]
+
+    w = DiscambWrapper(random_structure, native_kernel=native_kernel)
+    w.set_d_min(4.0)
+    f_calcs = w.f_calc_multi_wavelength(anomalous_sets)
+    assert len(f_calcs) == len(anomalous_sets)
+
+    for anomalous, f_calc in zip(anomalous_sets, f_calcs):
+        for sc, fp_fdp in zip(scatterers, anomalous):
+            sc.fp = fp_fdp.real
+            sc.fdp = fp_fdp.imag
+        reference = DiscambWrapper(random_structure)
+        reference.set_indices(w.get_indices())
+        assert pytest.approx(reference.f_calc()) == f_calc
+
+
+def test_pruning(tyrosine):
+    from pydiscamb import DiscambWrapper
+    import numpy as np
+
+    tyrosine.convert_to_isotropic()
+    exact = DiscambWrapper(tyrosine).f_calc(1.0)
+
+    w = DiscambWrapper(tyrosine)
+    w.set_pruning(0.0)
+    assert pytest.approx(exact) == w.f_calc(1.0)
+    assert w.stats.pruned_fraction == 0.0
+
+    w.set_pruning(0.05)
+    approximate = w.f_calc(1.0)
+    assert 0.0 < w.stats.pruned_fraction < 1.0
+    error = np.abs(np.array(approximate) - np.array(exact))
+    assert error.max() <= w.stats.pruning_error_bound + 1e-6
+
+
+def test_twinned_intensities(random_structure):
+    from pydiscamb import DiscambWrapper
+
+    identity = [[1, 0, 0], [0, 1, 0], [0, 0, 1]]
+    twin_law = [[0, 1, 0], [1, 0, 0], [0, 0, -1]]
+    fractions = [0.7, 0.3]
+    w = DiscambWrapper(random_structure)
+    w.set_d_min(3.0)
+    indices = w.get_indices()
+    twinned = w.i_calc_twinned([identity, twin_law], fractions)
+    assert w.reflection_set_names() == []
+
+    related = [(k, h, -l) for h, k, l in indices]
+    w.set_indices(related, "related")
+    f, f_related = w.f_calc(), w.f_calc("related")
+    expected = [0.7 * abs(a) ** 2 + 0.3 * abs(b) ** 2 for a, b in zip(f, f_related)]
+    assert pytest.approx(expected) == twinned
+
+    # Chain rule through I = sum_k a_k |F_k|^2
+    d_target_d_i_calc = [(i % 5) - 2.0 for i in range(len(indices))]
+    derivatives, d_fractions = w.d_target_d_params_twinned([identity, twin_law], fractions, d_target_d_i_calc)
+    assert pytest.approx(sum(d * abs(a) ** 2 for d, a in zip(d_target_d_i_calc, f))) == d_fractions[0]
+    assert pytest.approx(sum(d * abs(b) ** 2 for d, b in zip(d_target_d_i_calc, f_related))) == d_fractions[1]
+    direct = w.d_target_d_params([2 * 0.7 * d * a for d, a in zip(d_target_d_i_calc, f)])
+    direct_related = w.d_target_d_params([2 * 0.3 * d * b for d, b in zip(d_target_d_i_calc, f_related)], "related")
+    for a, d, r in zip(derivatives, direct, direct_related):
+        expected_sites = [x + y for x, y in zip(d.site_derivatives, r.site_derivatives)]
+        assert pytest.approx(expected_sites, rel=1e-6, abs=1e-8) == a.site_derivatives
+        expected_adp = [x + y for x, y in zip(d.adp_derivatives, r.adp_derivatives)]
+        assert pytest.approx(expected_adp, rel=1e-6, abs=1e-8) == a.adp_derivatives
+        expected_occupancy = d.occupancy_derivatives + r.occupancy_derivatives
+        assert pytest.approx(expected_occupancy, rel=1e-6, abs=1e-8) == a.occupancy_derivatives
+
+    # Finite differences of T = sum_i d_i I_i, with the Cartesian site, U_iso and occupancy
+    def target():
+        w.update_parameters()
+        twinned = w.i_calc_twinned([identity, twin_law], fractions)
+        return sum(d * i for d, i in zip(d_target_d_i_calc, twinned))
+
+    step = 1e-3
+    scatterer = random_structure.scatterers()[0]
+    unit_cell = random_structure.unit_cell()
+    site_cart = unit_cell.orthogonalize(scatterer.site)
+    for k in range(3):
+        shifted = []
+        for sign in (1, -1):
+            moved = list(site_cart)
+            moved[k] += sign * step
+            scatterer.site = unit_cell.fractionalize(moved)
+            shifted.append(target())
+        scatterer.site = unit_cell.fractionalize(site_cart)
+        numeric = (shifted[0] - shifted[1]) / (2 * step)
+        assert pytest.approx(numeric, rel=1e-2, abs=1e-3) == derivatives[0].site_derivatives[k]
+
+    u_iso = scatterer.u_iso
+    shifted = []
+    for sign in (1, -1):
+        scatterer.u_iso = u_iso + sign * step
+        shifted.append(target())
+    scatterer.u_iso = u_iso
+    numeric = (shifted[0] - shifted[1]) / (2 * step)
+    assert pytest.approx(numeric, rel=1e-2, abs=1e-3) == derivatives[0].adp_derivatives[0]
+
+    occupancy = scatterer.occupancy
+    shifted = []
+    for sign in (1, -1):
+        scatterer.occupancy = occupancy + sign * step
+        shifted.append(target())
+    scatterer.occupancy = occupancy
+    numeric = (shifted[0] - shifted[1]) / (2 * step)
+    assert pytest.approx(numeric, rel=1e-2, abs=1e-3) == derivatives[0].occupancy_derivatives